@@ -0,0 +1,41 @@
+/* 
+ * myburst.c - A process churn generator for testing your tiny shell
+ * 
+ * usage: myburst <n>
+ * Forks <n> children that exit immediately, keeping up to 64 of them
+ * outstanding, and reaps them all.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAXOUT 64 /* max children not yet reaped */
+
+int main(int argc, char **argv) 
+{
+    int i, n, out = 0;
+    pid_t pid;
+
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s <n>\n", argv[0]);
+	exit(0);
+    }
+    n = atoi(argv[1]);
+
+    for (i=0; i < n; i++) {
+	if (out == MAXOUT && wait(NULL) > 0)
+	    out--;
+	if ((pid = fork()) < 0) {
+	    perror("fork");
+	    exit(1);
+	}
+	if (pid == 0)
+	    _exit(0);
+	out++;
+    }
+    while (wait(NULL) > 0)
+	;
+    exit(0);
+}
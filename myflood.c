@@ -0,0 +1,39 @@
+/* 
+ * myflood.c - A high-volume writer for testing your tiny shell
+ * 
+ * usage: myflood <bytes>
+ * Writes <bytes> bytes of "y\n" lines to stdout as fast as it can.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK 65536 /* bytes per write */
+
+int main(int argc, char **argv) 
+{
+    static char buf[CHUNK];
+    long long left;
+    ssize_t n;
+    int i;
+
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s <bytes>\n", argv[0]);
+	exit(0);
+    }
+    left = atoll(argv[1]);
+
+    for (i=0; i < CHUNK; i += 2)
+	memcpy(buf + i, "y\n", 2);
+
+    while (left > 0) {
+	n = write(STDOUT_FILENO, buf, left < CHUNK ? left : CHUNK);
+	if (n < 0) {
+	    perror("write");
+	    exit(1);
+	}
+	left -= n;
+    }
+    exit(0);
+}
@@ -0,0 +1,34 @@
+/* 
+ * myserver.c - A line-at-a-time server for testing your tiny shell
+ * 
+ * usage: myserver [<query>]
+ * Answers <query> with "<query> ok" and exits, or without one answers
+ * every line of stdin that way, one line at a time, until end of file.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAXLINE 1024 /* max query size */
+
+int main(int argc, char **argv) 
+{
+    char line[MAXLINE];
+
+    if (argc > 2) {
+	fprintf(stderr, "Usage: %s [<query>]\n", argv[0]);
+	exit(0);
+    }
+    if (argc == 2) {
+	printf("%s ok\n", argv[1]);
+	exit(0);
+    }
+
+    while (fgets(line, MAXLINE, stdin) != NULL) {
+	line[strcspn(line, "\n")] = '\0';
+	printf("%s ok\n", line);
+	fflush(stdout);
+    }
+    exit(0);
+}
@@ -0,0 +1,50 @@
+/* 
+ * mysigstorm.c - A job control stress test for your tiny shell
+ * 
+ * usage: mysigstorm <n>
+ * Forks a child in its own process group (the job's) and stops it with
+ * SIGSTOP and continues it with SIGCONT <n> times, waiting for each
+ * state change, then kills it.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+
+int main(int argc, char **argv) 
+{
+    int i, n, status;
+    pid_t pid;
+
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s <n>\n", argv[0]);
+	exit(0);
+    }
+    n = atoi(argv[1]);
+
+    if ((pid = fork()) < 0) {
+	perror("fork");
+	exit(1);
+    }
+    if (pid == 0) { /* child */
+	for (;;)
+	    pause();
+    }
+
+    for (i=0; i < n; i++) {
+	kill(pid, SIGSTOP);
+	if (waitpid(pid, &status, WUNTRACED) < 0 || !WIFSTOPPED(status))
+	    break;
+	kill(pid, SIGCONT);
+	if (waitpid(pid, &status, WCONTINUED) < 0 || !WIFCONTINUED(status))
+	    break;
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    if (i < n)
+	fprintf(stderr, "%s: stopped after %d cycles\n", argv[0], i);
+    exit(0);
+}
@@ -0,0 +1,46 @@
+/* 
+ * mytree.c - A process tree generator for testing your tiny shell
+ * 
+ * usage: mytree <depth> <fanout>
+ * Every process down to <depth> levels forks <fanout> children and
+ * waits for them, for (fanout^(depth+1)-1)/(fanout-1) processes in all.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+void grow(int depth, int fanout)
+{
+    int i;
+    pid_t pid;
+
+    for (i=0; i < fanout && depth > 0; i++) {
+	if ((pid = fork()) < 0) {
+	    perror("fork");
+	    break;
+	}
+	if (pid == 0) {
+	    grow(depth - 1, fanout);
+	    exit(0);
+	}
+    }
+    while (wait(NULL) > 0)
+	;
+}
+
+int main(int argc, char **argv) 
+{
+    int depth, fanout;
+
+    if (argc != 3) {
+	fprintf(stderr, "Usage: %s <depth> <fanout>\n", argv[0]);
+	exit(0);
+    }
+    depth = atoi(argv[1]);
+    fanout = atoi(argv[2]);
+
+    grow(depth, fanout);
+    exit(0);
+}
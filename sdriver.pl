@@ -33,7 +33,7 @@ use File::Temp qw/ tempfile tempdir /;
 #     KILL        Send a SIGKILL signal to the child
 #     CLOSE       Close Writer (sends EOF signal to child)
 #     WAIT        Wait() for child to terminate
-#     SLEEP <n>   Sleep for <n> seconds
+#     SLEEP <n>   Sleep for <n> seconds (fractions allowed)
 # 
 ######################################################################
 
@@ -178,11 +178,11 @@ while (<INFILE>) {
     }
 
     # Sleep
-    elsif ($line =~ /SLEEP (\d+)/) {
+    elsif ($line =~ /SLEEP (\d*\.?\d+)/) {
 	if ($verbose) {
 	    print "$0: Sleeping $1 secs\n";
 	}
-	sleep $1;
+	select(undef, undef, undef, $1);
     }
 
     # Other input
@@ -3,6 +3,7 @@
  * 
  * <Put your name and login ID here>
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,13 +12,52 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <errno.h>
+#include <termios.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sched.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
 
 /* Misc manifest constants */
 #define MAXLINE 1024   /* max line size */
 #define MAXARGS 128    /* max args on a command line */
-#define MAXJOBS 16     /* max jobs at any point in time */
+#define MAXJOBS 1024   /* max jobs at any point in time */
 #define MAXJID 1 << 16 /* max job ID */
+#define MAXVARS 256    /* max shell variables */
+#define MAXFUNCS 64    /* max shell functions */
+#define MAXCALLS 64    /* max nesting of shell function calls */
+#define MAXHIST 1000   /* max lines kept in the history */
+#define MAXPATHDIRS 64 /* max PATH directories indexed for completion */
+#define MAXLIST 100    /* max completions listed at once */
+#define SCAN_MS 5      /* PATH scanning per timer tick, in milliseconds */
+#define MAXLIMITS 8    /* max resource limits per job */
+#define TICK_MS 10     /* timer wheel resolution in milliseconds */
+#define WHEEL_BITS 6   /* 64 slots per level of the timer wheel */
+#define WHEEL_LEVELS 4 /* 64^4 ticks (46 hours) ahead at most */
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define GRACE_MS 5000  /* SIGTERM to SIGKILL for timeout without -k and dag */
+#define MAXFDS 1024    /* fds the event loop can watch */
+#define MAXDONE 256    /* finished jobs the control socket remembers */
+#define MAXPOOL 64     /* max idle launchers (LAUNCHERS) */
+#define NSLOTS 1024    /* processes whose start is timed at once */
+#define HIST_SUB 4     /* histograms: 1 << HIST_SUB buckets per power of two */
+#define HIST_BUCKETS ((65 - HIST_SUB) << HIST_SUB)
+#define MAXOUTS 8      /* max > and >> files of one pipeline stage */
+#define MAXCOPROCS 16  /* max coprocesses at once */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -25,6 +65,18 @@
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
 
+/* Control flow results of the interpreter */
+#define FLOW_NEXT 0     /* run the next statement */
+#define FLOW_BREAK 1    /* leave the innermost loop */
+#define FLOW_CONTINUE 2 /* start the next iteration of the innermost loop */
+#define FLOW_RETURN 3   /* leave the current function */
+#define FLOW_ERROR 4    /* syntax error, abandon the whole command */
+
+/* Kinds of output redirection */
+#define OUT_TRUNC 0  /* > file */
+#define OUT_APPEND 1 /* >> file */
+#define OUT_COPROC 2 /* >&NAME, the stdin of a coprocess */
+
 /* 
  * Jobs states: FG (foreground), BG (background), ST (stopped)
  * Job state transitions and enabling actions:
@@ -41,6 +93,69 @@ char prompt[] = "tsh> "; /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;         /* if true, print additional output */
 int nextjid = 1;         /* next job ID to allocate */
 char sbuf[MAXLINE];      /* for composing sprintf messages */
+int emit_prompt = 1;     /* emit prompt (default) */
+int last_status = 0;     /* exit status of the last foreground command */
+pid_t last_bg_pid = 0;   /* PID of the most recent background job */
+int interactive = 0;     /* if true, tsh owns a controlling terminal */
+pid_t shell_pgid;        /* tsh's own process group */
+struct termios shell_tmodes; /* terminal modes for the prompt */
+sigset_t job_mask;       /* signal mask jobs start with (tsh's own at startup) */
+int daemon_mode = 0;     /* if true, tsh serves a control socket (-S) */
+int log_fd = -1;         /* daemon mode: where jobs and tsh itself write */
+int null_fd = -1;        /* daemon mode: the stdin of jobs */
+
+struct limit_t
+{                  /* A resource limit set with limit name=value */
+    int resource;  /* RLIMIT_... */
+    rlim_t value;  /* the soft limit */
+    char text[32]; /* name=value as typed */
+};
+
+struct jobopts_t
+{                    /* Placement and limits for every process of a job */
+    int has_cpus;    /* if true, run on cpus only */
+    cpu_set_t cpus;  /* allowed CPUs */
+    char cpulist[64]; /* cpus as typed, e.g. 0-3,8 */
+    int has_nice;    /* if true, adjust the niceness */
+    int nice;        /* niceness relative to the shell */
+    int nlimits;     /* number of limits */
+    struct limit_t limits[MAXLIMITS]; /* soft resource limits */
+    int has_timeout; /* if true, the job has a deadline */
+    long long timeout_ms; /* how long it may run */
+    long long grace_ms;   /* SIGTERM to SIGKILL once the time is up */
+    char timeout[32];     /* the duration as typed, e.g. 30s */
+};
+
+struct launch_t
+{                          /* How to start one stage of a job */
+    pid_t pgid;            /* process group to join, 0 for a new one */
+    int fg;                /* if true, the stage takes the terminal */
+    struct jobopts_t opts; /* affinity, nice and limits */
+    int fdmask;            /* which of stdin/out/err and pipe ends were sent */
+    int argc;              /* strings of argv at the start of args */
+    int in_redir;          /* offset of the < file in args, -1 if none */
+    int out_redir;         /* offset of the > file in args, -1 if none */
+    int out_append;        /* if true, the > file was given with >> */
+    int len;               /* bytes used in args */
+    char args[MAXLINE];    /* NUL separated argv, then the files */
+    char cmdline[MAXLINE]; /* the job's command line, for errors */
+    int slot;              /* exec_slots entry to time it in, -1 if none */
+};
+
+struct launcher_t
+{              /* An idle launcher */
+    pid_t pid;
+    int sock;  /* where its launch_t goes */
+};
+
+struct wtimer
+{                            /* A timer in the timer wheel */
+    unsigned long expires;   /* tick at which it fires */
+    struct wtimer *next;     /* next timer in the same slot */
+    struct wtimer **pprev;   /* link that points at it, NULL if not pending */
+    void (*fn)(struct wtimer *t); /* called when it fires */
+    void *arg;               /* for fn */
+};
 
 struct job_t
 {                          /* The job struct */
@@ -49,8 +164,182 @@ struct job_t
     int jid;               /* job ID [1, 2, ...] */
     int state;             /* UNDEF, BG, FG, or ST */
     char cmdline[MAXLINE]; /* command line */
+    int has_tmodes;        /* if true, tmodes holds the job's terminal modes */
+    struct termios tmodes; /* terminal modes saved when the job stopped */
+    struct jobopts_t opts; /* affinity, nice and limits of its processes */
+    long long deadline;    /* now_ms() at which the timeout acts next */
+    int timed_out;         /* if true, SIGTERM was sent at the deadline */
+    struct wtimer timer;   /* fires at the deadline */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
+
+struct joblog_t
+{                   /* Captured output of a background job */
+    int fd;         /* read end of the pipe the job writes into */
+    int wfd;        /* write end, until the job has started; then -1 */
+    int jid;        /* the job */
+    pid_t pid;
+    char *buf;      /* ring with the last size bytes */
+    size_t size;
+    unsigned long long total; /* bytes the job has written */
+};
+struct joblog_t *joblogs[MAXFDS]; /* by the fd of their pipe */
+size_t joblog_mem = 0;            /* bytes held by all rings */
+struct launcher_t pool[MAXPOOL];  /* idle launchers */
+int npool = 0;                    /* number of idle launchers */
+
+struct outs_t
+{                        /* Where one pipeline stage's stdout goes */
+    int n;               /* number of > and >> files and >&NAME */
+    char *file[MAXOUTS]; /* each file, or the name of the coprocess */
+    int how[MAXOUTS];    /* OUT_TRUNC, OUT_APPEND or OUT_COPROC */
+};
+
+struct fanout_t
+{                             /* A stage's stdout copied to several sinks */
+    int fd;                   /* read end of the pipe the stage writes into */
+    int wfd;                  /* write end, until the stage has started; then -1 */
+    int n;                    /* number of sinks */
+    int live;                 /* sinks not yet dropped */
+    int watched;              /* if true, fd is in the epoll set */
+    int sink[MAXOUTS + 1];    /* files and the pipe to the next stage, -1 if dropped */
+    char *name[MAXOUTS + 1];  /* the file, NULL for the pipe */
+    int buf[MAXOUTS + 1][2];  /* per sink, a pipe with what it has yet to take */
+    size_t left[MAXOUTS + 1]; /* bytes in buf */
+    int blocked[MAXOUTS + 1]; /* if true, waiting for the sink to take more */
+    int copy[MAXOUTS + 1];    /* if true, splice() can't write to the sink */
+};
+struct fanout_t *fanouts[MAXFDS]; /* by the fd of their pipe and pipe sinks */
+void (*reap_hook)(struct job_t *job, int status); /* told of each job that ends */
+
+struct hist_t
+{                                 /* Latencies (ns) or counts, within 1/16 */
+    unsigned long long count;     /* values added */
+    unsigned long long sum;       /* their sum */
+    unsigned long long max;       /* the largest */
+    unsigned long long n[HIST_BUCKETS]; /* values in each bucket */
+};
+
+struct stats_t
+{                                 /* Counters since startup or stats -r */
+    unsigned long long builtins;  /* commands tsh ran itself */
+    unsigned long long externals; /* commands that started a job */
+    unsigned long long forks;     /* stages started with fork() */
+    unsigned long long handoffs;  /* stages started by a launcher */
+    unsigned long long spawns;    /* launchers forked */
+    unsigned long long exec_failed; /* stages that never reached execve */
+    unsigned long long exited;    /* jobs that exited */
+    unsigned long long signaled;  /* jobs killed by a signal */
+    unsigned long long timed_out; /* jobs ended by their timeout */
+    unsigned long long stopped;   /* times a job stopped */
+    unsigned long long sigchlds;  /* SIGCHLD batches */
+    unsigned long long reaps;     /* children reaped */
+    struct hist_t batch;          /* children reaped per SIGCHLD batch */
+    struct hist_t fork_exec;      /* fork or hand-off to execve */
+    struct hist_t exec_exit;      /* execve to reap */
+    struct hist_t chld_reap;      /* SIGCHLD (handler entry) to reap */
+};
+struct stats_t stats;
+
+struct exec_slot
+{                      /* What a starting stage tells tsh */
+    long long exec_ns; /* now_ns() right before execve */
+    int failed;        /* if true, it never got to run */
+};
+struct exec_slot *exec_slots;  /* NSLOTS, in memory shared with children */
+int slots_fd = -1;             /* the memfd behind it, for launchers */
+pid_t slot_pid[NSLOTS];        /* process timed in each slot, -1 while starting */
+long long slot_start[NSLOTS];  /* now_ns() when it was forked or handed off */
+int nslots = 0;                /* slots ever used */
+
+struct stmts_t
+{              /* A list of statements for the interpreter */
+    char **s;  /* statement text, one simple command or keyword each */
+    int n;     /* number of statements */
+    int cap;   /* allocated slots */
+};
+
+struct var_t
+{                /* A shell variable */
+    char *name;  /* variable name */
+    char *value; /* variable value */
+};
+struct var_t vars[MAXVARS]; /* The variable table */
+
+struct body_t
+{                        /* The body of a shell function */
+    struct stmts_t st;   /* statements between { and } */
+    int refs;            /* number of active calls running it */
+};
+
+struct func_t
+{                        /* A shell function */
+    char *name;          /* function name */
+    struct body_t *body; /* its current body */
+};
+struct func_t funcs[MAXFUNCS]; /* The function table */
+
+char **posargs = NULL; /* positional parameters of the current function */
+int nposargs = 0;      /* number of positional parameters */
+int ncalls = 0;        /* current function call depth */
+int nloops = 0;        /* current loop nesting depth */
+char *heredoc_text = NULL; /* lines of the here-documents of eval()'s command */
+
+int epfd = -1;              /* epoll set the shell sleeps in */
+int timer_fd = -1;          /* timerfd that ticks the timer wheel */
+int stdin_pollable = 0;     /* if true, stdin can be in the epoll set */
+int stdin_watched = 0;      /* if true, stdin is in the epoll set */
+struct wtimer *wheel[WHEEL_LEVELS][WHEEL_SIZE]; /* pending timers by slot */
+unsigned long wheel_now = 0; /* ticks run so far */
+int ntimers = 0;            /* pending timers */
+typedef void watch_fn(int fd, uint32_t events);
+watch_fn *watchers[MAXFDS]; /* handlers of the fds in the epoll set */
+
+int editing = 0;            /* if true, read lines with the line editor */
+int line_shown = 0;         /* if true, the editor's line is on the screen */
+int async_output = 0;       /* if true, something was printed over it */
+char *history[MAXHIST];     /* lines entered, oldest first */
+int nhist = 0;              /* number of history lines */
+
+struct editor
+{                        /* State of the line being edited */
+    char buf[MAXLINE];   /* the line */
+    int len;             /* its length */
+    int pos;             /* cursor position in buf */
+    char shown[MAXLINE]; /* what the terminal shows after the prompt */
+    int shown_len;       /* its length */
+    int shown_pos;       /* where the terminal cursor is in shown */
+    char *prompt;        /* prompt printed before the line */
+    int hist;            /* history line being edited, nhist for a new one */
+    char saved[MAXLINE]; /* the new line while browsing the history */
+    int tabs;            /* consecutive tab presses */
+    int esc;             /* in an escape sequence: 1 after ESC, 2 after ESC [ */
+    int arg;             /* numeric argument of the escape sequence */
+};
+
+struct cnode
+{                  /* A node of the completion trie */
+    char c;        /* last character of the name prefix it stands for */
+    int child;     /* first child, 0 if none */
+    int next;      /* next sibling in character order, 0 if none */
+    int nwords;    /* number of names ending at or below this node */
+    uint64_t dirs; /* PATH directories holding the name (bit i: pathdirs[i]) */
+    int builtin;   /* the name is a builtin or keyword */
+};
+struct cnode *ctrie = NULL; /* completion trie, node 0 is the root */
+int nnodes = 0;             /* nodes in use */
+int capnodes = 0;           /* nodes allocated */
+
+struct cdir
+{                          /* A PATH directory indexed in the trie */
+    char path[MAXLINE];    /* directory name */
+    struct timespec mtime; /* its modification time when it was scanned */
+    int scanned;           /* if true, its names are (being put) in the trie */
+    DIR *scan;             /* open while the scan is still in progress */
+};
+struct cdir pathdirs[MAXPATHDIRS]; /* PATH directories, in search order */
+int npathdirs = 0;                 /* number of PATH directories */
+char *cached_path = NULL;          /* the PATH that pathdirs was built from */
 /* End global variables */
 
 /* Function prototypes */
@@ -59,7 +348,58 @@ struct job_t jobs[MAXJOBS]; /* The job list */
 void eval(char *cmdline);
 int builtin_cmd(char **argv);
 void do_bgfg(char **argv);
+int do_kill(char **argv);
 void waitfg(pid_t pid);
+void init_terminal(void);
+void give_terminal(struct job_t *job);
+int parse_jobopts(char **argv, struct jobopts_t *o);
+void merge_jobopts(struct jobopts_t *dst, const struct jobopts_t *src);
+int apply_jobopts(const struct jobopts_t *o);
+int repin_job(struct job_t *job, const struct jobopts_t *o);
+
+/* Event loop routines */
+void init_events(void);
+void run_daemon(const char *path);
+int watch_fd(int fd, uint32_t events, watch_fn *fn);
+void unwatch_fd(int fd);
+int wait_event(int timeout_ms, const sigset_t *sigmask, int want_stdin);
+char *read_line(char *buf);
+long long now_ms(void);
+void timer_add(struct wtimer *t, long long ms);
+void timer_cancel(struct wtimer *t);
+void start_job_timer(struct job_t *job);
+
+/* Background job output capture */
+struct joblog_t *joblog_open(void);
+void joblog_start(struct joblog_t *log, struct job_t *job);
+void joblog_discard(struct joblog_t *log);
+int do_joblog(char **argv);
+
+/* Job stages and the launcher pool */
+int pack_stage(struct launch_t *l, char **argv, char *in, char *out, const char *cmdline);
+void start_stage(struct launch_t *l, int *fds);
+void pool_refill(void);
+pid_t pool_launch(struct launch_t *l, int *fds);
+void launcher_main(void);
+
+/* Fan-out of a stage's output */
+struct fanout_t *fanout_open(void);
+int fanout_add(struct fanout_t *f, int fd, const char *name);
+int fanout_file(struct fanout_t *f, const char *path, int append);
+void fanout_start(struct fanout_t *f);
+void fanout_discard(struct fanout_t *f);
+void fanout_settle(void);
+
+/* Runtime statistics */
+long long now_ns(void);
+void init_stats(void);
+int stats_slot(void);
+void stats_started(int slot, pid_t pid, int handoff);
+void stage_exec(int slot, int failed);
+void stats_reaped(pid_t pid, long long chld_ns);
+void stats_ended(struct job_t *job, int status);
+void stats_flush(void);
+int do_stats(char **argv);
 
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
@@ -67,19 +407,54 @@ void sigint_handler(int sig);
 
 /* Here are helper routines that we've provided for you */
 int parseline(const char *cmdline, char **argv);
-int parseargs(char **argv, int *cmds, int *stdin_redir, int *stdout_redir);
+int parseargs(char **argv, int *cmds, int *stdin_redir, struct outs_t *outs, int *here,
+              char **co_in);
 void sigquit_handler(int sig);
 
+/* Interpreter routines for compound commands and functions */
+char *read_cmdline(char *buf, char *prompt_str);
+void run_line(char *cmdline);
+void split_stmts(const char *text, struct stmts_t *st);
+void free_stmts(struct stmts_t *st);
+int exec_stmts(char **s, int lo, int hi);
+int exec_simple(char *stmt);
+int expand_line(const char *in, char *out, int size);
+int expand_text(const char *in, char *out, int size, int words);
+char *getvar(const char *name);
+void setvar(const char *name, const char *value);
+int do_test(char **argv);
+static int funcname(const char *stmt, char *name);
+
+/* Here-documents and here-strings */
+void read_heredocs(struct stmts_t *st, int from);
+int open_heredocs(const char *cmdline, const char *text, int *fds, int max);
+
+/* Task graphs */
+int do_dag(char **argv);
+
+/* Coprocesses */
+struct coproc_t *coproc_open(const char *name, int *ends);
+void coproc_started(struct coproc_t *co, struct job_t *job, int *ends);
+void coproc_discard(struct coproc_t *co, int *ends);
+int coproc_fd(const char *name, int reading);
+int io_builtin(char **argv, char *in, struct outs_t *outs, char *co_in);
+int do_coproc(char **argv);
+
+/* Line editor routines */
+void init_editor(void);
+char *edit_line(char *buf, char *prompt_str);
+
 void clearjob(struct job_t *job);
 void initjobs(struct job_t *jobs);
 int maxjid(struct job_t *jobs);
+int job_slot_free(void);
 int addjob(struct job_t *jobs, pid_t pid, pid_t pgid, int state, char *cmdline);
 int deletejob(struct job_t *jobs, pid_t pid);
 pid_t fgpid(struct job_t *jobs);
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
 struct job_t *getjobjid(struct job_t *jobs, int jid);
 int pid2jid(pid_t pid);
-void listjobs(struct job_t *jobs);
+void listjobs(struct job_t *jobs, int details);
 void updateJobState(struct job_t *jobs, pid_t pid, int state);
 
 void usage(void);
@@ -95,14 +470,16 @@ int main(int argc, char **argv)
 {
     char c;
     char cmdline[MAXLINE];
-    int emit_prompt = 1; /* emit prompt (default) */
+    char *ctl_path = NULL;
+
+    sigprocmask(SIG_BLOCK, NULL, &job_mask);
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF)
+    while ((c = getopt(argc, argv, "hvpS:L:")) != EOF)
     {
         switch (c)
         {
@@ -115,6 +492,13 @@ int main(int argc, char **argv)
         case 'p':            /* don't print a prompt */
             emit_prompt = 0; /* handy for automatic testing */
             break;
+        case 'S': /* take jobs from a control socket */
+            ctl_path = optarg;
+            break;
+        case 'L': /* a launcher of the pool, started by tsh itself */
+            interactive = atoi(optarg);
+            launcher_main();
+            break;
         default:
             usage();
         }
@@ -130,29 +514,37 @@ int main(int argc, char **argv)
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler);
 
+    /* A fan-out whose reader went away gets EPIPE, not a dead shell */
+    Signal(SIGPIPE, SIG_IGN);
+
+    /* Sleep in one epoll set, with the timer wheel's timerfd in it */
+    init_events();
+
     /* Initialize the job list */
     initjobs(jobs);
+    init_stats();
+
+    /* Serve the control socket until shutdown instead of reading stdin */
+    if (ctl_path != NULL)
+        run_daemon(ctl_path);
+
+    /* Take control of the terminal, if there is one */
+    init_terminal();
+    init_editor();
 
     /* Execute the shell's read/eval loop */
     while (1)
     {
 
         /* Read command line */
-        if (emit_prompt)
-        {
-            printf("%s", prompt);
-            fflush(stdout);
-        }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin))
+        if (read_cmdline(cmdline, prompt) == NULL)
         { /* End of file (ctrl-d) */
             fflush(stdout);
             exit(0);
         }
 
         /* Evaluate the command line */
-        eval(cmdline);
+        run_line(cmdline);
         fflush(stdout);
         fflush(stdout);
     }
@@ -176,20 +568,118 @@ void eval(char *cmdline)
     char *args[MAXARGS];
     int cmds[MAXARGS];
     int stdin_redir[MAXARGS];
-    int stdout_redir[MAXARGS];
-    char *newenviron[] = {NULL};
+    struct outs_t outs[MAXARGS];
+    int here[MAXARGS];
+    char *co_in[MAXARGS];
+    int docs[MAXARGS];
     int fd[2];
-    int lastChildFdRead;
+    int lastChildFdRead = -1;
     int groupPid;
     int mostRecentChildPid;
+    sigset_t mask_chld, prev_mask;
+    struct jobopts_t opts;
+    struct job_t *job;
+    struct joblog_t *log = NULL;
+    struct fanout_t *fan;
+    struct coproc_t *co = NULL;
+    struct launch_t stage;
+    int stage_fds[5];
+    int co_ends[2] = {-1, -1};
+    int nopts, ndocs, k, next;
 
     int runInBg = parseline(cmdline, args);
-    int numCmds = parseargs(args, cmds, stdin_redir, stdout_redir);
+
+    // coproc NAME cmd: a background job with its stdin and stdout
+    // piped to tsh
+    if (args[0] != NULL && strcmp(args[0], "coproc") == 0 &&
+        args[1] != NULL && args[1][0] != '-' && args[2] != NULL)
+    {
+        if ((co = coproc_open(args[1], co_ends)) == NULL)
+        {
+            last_status = 1;
+            return;
+        }
+        for (k = 0; (args[k] = args[k + 2]) != NULL; k++)
+            ;
+        runInBg = 1;
+    }
+
+    // affinity/nice/limit prefixes apply to every stage of the job
+    memset(&opts, 0, sizeof(opts));
+    if (args[0] != NULL && (nopts = parse_jobopts(args, &opts)) != 0)
+    {
+        last_status = 2;
+        if (nopts < 0 || args[nopts] == NULL)
+        {
+            if (nopts > 0)
+                printf("%s: missing command\n", args[0]);
+            if (co != NULL) coproc_discard(co, co_ends);
+            return;
+        }
+        for (k = 0; (args[k] = args[nopts + k]) != NULL; k++)
+            ;
+    }
+    int numCmds = parseargs(args, cmds, stdin_redir, outs, here, co_in);
 
     if (numCmds < 1)
+    {
+        if (numCmds < 0)
+            last_status = 2;
+        if (co != NULL) coproc_discard(co, co_ends);
+        return;
+    }
+    // echo and read run in tsh, which can't also go on to the next command
+    if (co == NULL && numCmds == 1 && runInBg &&
+        (strcmp(args[0], "echo") == 0 || strcmp(args[0], "read") == 0))
+    {
+        printf("%s: can't run in the background\n", args[0]);
+        last_status = 1;
+        return;
+    }
+    if (co == NULL && numCmds == 1 &&
+        (k = io_builtin(args, stdin_redir[0] > 0 ? args[stdin_redir[0]] : NULL,
+                        &outs[0], co_in[0])) >= 0)
+    {
+        last_status = k;
+        stats.builtins++;
+        return;
+    }
+    if (co == NULL && builtin_cmd(args) != 0)
+    {
+        stats.builtins++;
         return;
-    if (builtin_cmd(args) != 0)
+    }
+    // every <&NAME and >&NAME has to name a coprocess
+    for (int i = 0; i < numCmds; i++)
+    {
+        for (k = 0; k < outs[i].n; k++)
+            if (outs[i].how[k] == OUT_COPROC && coproc_fd(outs[i].file[k], 0) < 0)
+                break;
+        if (k < outs[i].n || (co_in[i] != NULL && coproc_fd(co_in[i], 1) < 0))
+        {
+            last_status = 1;
+            if (co != NULL) coproc_discard(co, co_ends);
+            return;
+        }
+    }
+    if ((ndocs = open_heredocs(cmdline, heredoc_text, docs, MAXARGS)) < 0)
+    {
+        last_status = 1;
+        if (co != NULL) coproc_discard(co, co_ends);
         return;
+    }
+
+    // keep SIGCHLD out until the job is in the job list, otherwise a
+    // child that exits right away is reaped before addjob() sees it;
+    // ctrl-c/ctrl-z wait until the child has dropped tsh's handlers
+    sigemptyset(&mask_chld);
+    sigaddset(&mask_chld, SIGCHLD);
+    sigaddset(&mask_chld, SIGINT);
+    sigaddset(&mask_chld, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask_chld, &prev_mask);
+    fflush(stdout); // or the children inherit what is still buffered
+    if (runInBg)
+        log = joblog_open();
 
     // loop for each cmd
     for (int i = 0; i < numCmds; i++)
@@ -199,87 +689,141 @@ void eval(char *cmdline)
             if (pipe(fd)==-1) 
             { 
                 fprintf(stderr,"Pipe Failed" ); 
+                if (log != NULL) joblog_discard(log);
+                if (co != NULL) coproc_discard(co, co_ends);
+                for (k = 0; k < ndocs; k++) close(docs[k]);
+                sigprocmask(SIG_SETMASK, &prev_mask, NULL);
                 return; 
             }
             // fprintf(stderr,"New pipe read: %d; New pipe write: %d;\n", fd[0], fd[1]);
         }
 
 
-        int childPID;
-        if ((childPID = fork()) < 0)
+        // the next stage, or tsh for the last stage of a coprocess
+        next = i < numCmds-1 ? fd[1] : co != NULL ? co_ends[1] : -1;
+
+        // output that goes to more than one place (several > and >>
+        // files, or files and the next stage) is copied by tsh
+        fan = NULL;
+        if (outs[i].n + (next >= 0) > 1 && (fan = fanout_open()) != NULL)
+        {
+            for (k = 0; k < outs[i].n; k++)
+            {
+                int co_fd;
+
+                if (outs[i].how[k] != OUT_COPROC)
+                    fanout_file(fan, outs[i].file[k], outs[i].how[k] == OUT_APPEND);
+                else if ((co_fd = fcntl(coproc_fd(outs[i].file[k], 0), F_DUPFD_CLOEXEC, 0)) < 0 ||
+                         fanout_add(fan, co_fd, NULL) < 0)
+                {
+                    printf("%s: %s\n", outs[i].file[k], strerror(errno));
+                    if (co_fd >= 0)
+                        close(co_fd);
+                }
+            }
+            if (next >= 0 && fanout_add(fan, next, NULL) == 0)
+                next = -1; // the fan-out closes it
+            if (i == numCmds-1 && co != NULL)
+                co_ends[1] = next;
+        }
+        k = outs[i].n - 1; // the one place, if not fanned out
+
+        // describe the stage for a launcher from the pool, or a fork
+        pack_stage(&stage, &args[cmds[i]],
+                   stdin_redir[i] > 0 ? args[stdin_redir[i]] : NULL,
+                   k >= 0 && fan == NULL && outs[i].how[k] != OUT_COPROC ? outs[i].file[k] : NULL,
+                   cmdline);
+        stage.out_append = k >= 0 && outs[i].how[k] == OUT_APPEND;
+        stage.pgid = i == 0 ? 0 : groupPid;
+        stage.fg = !runInBg;
+        stage.opts = opts;
+        stage.slot = stats_slot();
+        // a here-document or the coprocess pipe is the stdin; otherwise
+        // jobs of the control socket read nothing, and they write to the log
+        stage_fds[0] = here[i] > 0 ? docs[here[i] - 1]
+                     : i == 0 && co != NULL ? co_ends[0]
+                     : daemon_mode ? null_fd : -1;
+        stage_fds[1] = stage_fds[2] = log != NULL ? log->wfd
+                                    : daemon_mode ? log_fd : -1;
+        stage_fds[3] = co_in[i] != NULL ? coproc_fd(co_in[i], 1)
+                     : i > 0 ? lastChildFdRead : -1;
+        stage_fds[4] = fan != NULL ? fan->wfd : next >= 0 ? next
+                     : k >= 0 && outs[i].how[k] == OUT_COPROC ? coproc_fd(outs[i].file[k], 0) : -1;
+
+        int childPID = pool_launch(&stage, stage_fds);
+        int handoff = childPID != 0;
+        if (!handoff && (childPID = fork()) < 0)
         {
+            stats_started(stage.slot, childPID, 0);
             printf("Error creating child process.\n");
+            if (log != NULL) joblog_discard(log);
+            if (fan != NULL) fanout_discard(fan);
+            if (co != NULL) coproc_discard(co, co_ends);
+            for (k = 0; k < ndocs; k++) close(docs[k]);
+            sigprocmask(SIG_SETMASK, &prev_mask, NULL);
             return;
         }
 
         // Child Process
         if (childPID == 0)
         {
-            // handle stdin redirect
-            if (stdin_redir[i] > 0) {
-                FILE* in = fopen(args[stdin_redir[i]], "r");
-                dup2(fileno(in),fileno(stdin));
-            }
-            
-            // handle stdout redirect
-            if (stdout_redir[i] > 0) {
-                FILE* out = fopen(args[stdout_redir[i]], "w");
-                dup2(fileno(out),fileno(stdout));
-            }
-            
-
-            if (numCmds > 1){
-                // fprintf(stderr,"LastChildFdRead: %d. New pipe write: %d\n",lastChildFdRead,fd[1]);
-
-                if (i > 0) {
-                    dup2(lastChildFdRead,fileno(stdin));
-                };
-                // piping for others besides the last
-                if (i < numCmds-1) {
-                    // fprintf(stderr,"not last\n");
-                    // close read end
-                    close(fd[0]);
-                    // dup write to stdout
-                    dup2(fd[1],fileno(stdout));
-                }    
-            }
-
-            execve(args[cmds[i]], &args[cmds[i]], newenviron);
-            char cmdlnNoBreak[MAXLINE];
-            for (int i = 0; cmdline[i] != '\n'; i++) cmdlnNoBreak[i] = cmdline[i];
-            // char cmds[MAXLINE];
-            // strcpy(cmds, cmdline);
-            printf("%s: Command not found\n", cmdlnNoBreak);
-            exit(0);
+            if (i < numCmds-1) close(fd[0]);
+            start_stage(&stage, stage_fds);
         }
 
         // Parent Process
         else
         {
             if (i == 0) groupPid = childPID;
+            stats_started(stage.slot, childPID, handoff);
             setpgid(childPID, groupPid);
+            if (i == 0 && interactive && !runInBg)
+                tcsetpgrp(STDIN_FILENO, groupPid);
             mostRecentChildPid = childPID;
 
-            // piping
-            if (numCmds > 1) {
-                close(fd[1]);
-                lastChildFdRead = fd[0];
-            }
-
-            if (i < numCmds-1) wait(NULL);
+            // piping: keep only the read end the next stage needs; the
+            // stages run concurrently and the SIGCHLD handler reaps them
+            if (i > 0) close(lastChildFdRead);
+            if (next >= 0) close(next);
+            if (i < numCmds-1) lastChildFdRead = fd[0];
+            if (fan != NULL) fanout_start(fan);
         }
     }
 
+    for (k = 0; k < ndocs; k++) close(docs[k]);
     int state = runInBg ? BG : FG;
 
+    stats.externals++;
     addjob(jobs, mostRecentChildPid, groupPid, state, cmdline);
+    if ((job = getjobpid(jobs, mostRecentChildPid)) != NULL)
+    {
+        job->opts = opts;
+        if (opts.has_timeout)
+            start_job_timer(job);
+    }
+    if (log != NULL) {
+        if (job != NULL) joblog_start(log, job);
+        else joblog_discard(log);
+    }
+    if (co != NULL) {
+        co_ends[1] = -1; // closed with the last stage
+        if (job != NULL) coproc_started(co, job, co_ends);
+        else coproc_discard(co, co_ends);
+    }
 
-    if (state == BG) {
-        struct job_t* job = getjobpid(jobs, groupPid);
+    if (state == BG && job != NULL) {
+        last_bg_pid = mostRecentChildPid;
+        last_status = 0;
         printf("[%d] (%d) %s\n", job->jid, groupPid, cmdline);
     }
 
-    waitfg(mostRecentChildPid);
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+
+    if (state == FG)
+    {
+        waitfg(mostRecentChildPid);
+        fanout_settle(); // the files hold all the job wrote
+    }
 
     return;
 }
@@ -291,19 +835,29 @@ void eval(char *cmdline)
  * argument was | (pipe), then the next argument starts the new command on the
  * pipeline.  If the argument was < or >, then the next argument is the file
  * from/to which stdin or stdout should be redirected, respectively.  After it
- * runs, the arrays for cmds, stdin_redir, and stdout_redir all have the same
+ * runs, the arrays for cmds, stdin_redir, and outs all have the same
  * number of items---which is the number of commands in the pipeline.  The cmds
  * array is populated with the indexes of argv corresponding to the start of
  * each command sequence in the pipeline.  For each slot in cmds, there is a
- * corresponding slot in stdin_redir and stdout_redir.  If the slot has a -1,
- * then there is no redirection; if it is >= 0, then the value corresponds to
- * the index in argv that holds the filename associated with the redirection.
+ * corresponding slot in stdin_redir and outs.  If the stdin_redir slot has a
+ * -1, then there is no redirection; if it is >= 0, then the value corresponds
+ * to the index in argv that holds the filename associated with the redirection.
+ * The outs slot lists every > and >> file and >&NAME coprocess of the
+ * command, in order; all of them (and the next command, if piped) get the
+ * whole output.
+ * Likewise, here is 0 or the number (1, 2, ...) of the here-document or
+ * here-string (<<, <<- or <<<, with their word attached or next) the
+ * command reads instead, and co_in is the NAME of <&NAME or NULL; of
+ * those and a < file, the last one counts.
+ * Returns -1 if a command has more than MAXOUTS output files.
  * 
  */
-int parseargs(char **argv, int *cmds, int *stdin_redir, int *stdout_redir)
+int parseargs(char **argv, int *cmds, int *stdin_redir, struct outs_t *outs, int *here,
+              char **co_in)
 {
     int argindex = 0; /* the index of the current argument in the current cmd */
     int cmdindex = 0; /* the index of the current cmd */
+    int ndocs = 0;    /* here-documents so far */
 
     if (!argv[argindex])
     {
@@ -312,7 +866,9 @@ int parseargs(char **argv, int *cmds, int *stdin_redir, int *stdout_redir)
 
     cmds[cmdindex] = argindex;
     stdin_redir[cmdindex] = -1;
-    stdout_redir[cmdindex] = -1;
+    outs[cmdindex].n = 0;
+    here[cmdindex] = 0;
+    co_in[cmdindex] = NULL;
     argindex++;
     while (argv[argindex])
     {
@@ -325,16 +881,57 @@ int parseargs(char **argv, int *cmds, int *stdin_redir, int *stdout_redir)
                 break;
             }
             stdin_redir[cmdindex] = argindex;
+            here[cmdindex] = 0;
+            co_in[cmdindex] = NULL;
         }
-        else if (strcmp(argv[argindex], ">") == 0)
+        else if (strncmp(argv[argindex], "<<", 2) == 0)
         {
+            int bare = strcmp(argv[argindex], "<<") == 0 ||
+                       strcmp(argv[argindex], "<<-") == 0 ||
+                       strcmp(argv[argindex], "<<<") == 0;
             argv[argindex] = NULL;
-            argindex++;
-            if (!argv[argindex])
+            if (bare && !argv[++argindex])
+            { /* if we have reached the end, then break */
+                break;
+            }
+            here[cmdindex] = ++ndocs;
+            stdin_redir[cmdindex] = -1;
+            co_in[cmdindex] = NULL;
+        }
+        else if (strncmp(argv[argindex], "<&", 2) == 0)
+        {
+            char *name = argv[argindex] + 2;
+
+            argv[argindex] = NULL;
+            if (!*name && !(name = argv[++argindex]))
+            { /* if we have reached the end, then break */
+                break;
+            }
+            co_in[cmdindex] = name;
+            stdin_redir[cmdindex] = -1;
+            here[cmdindex] = 0;
+        }
+        else if (strcmp(argv[argindex], ">") == 0 ||
+                 strcmp(argv[argindex], ">>") == 0 ||
+                 strncmp(argv[argindex], ">&", 2) == 0)
+        {
+            struct outs_t *o = &outs[cmdindex];
+            int how = argv[argindex][1] == '>' ? OUT_APPEND
+                    : argv[argindex][1] == '&' ? OUT_COPROC : OUT_TRUNC;
+            char *name = how == OUT_COPROC ? argv[argindex] + 2 : "";
+
+            argv[argindex] = NULL;
+            if (!*name && !(name = argv[++argindex]))
             { /* if we have reached the end, then break */
                 break;
             }
-            stdout_redir[cmdindex] = argindex;
+            if (o->n == MAXOUTS)
+            {
+                printf("More than %d output files\n", MAXOUTS);
+                return -1;
+            }
+            o->file[o->n] = name;
+            o->how[o->n++] = how;
         }
         else if (strcmp(argv[argindex], "|") == 0)
         {
@@ -347,7 +944,9 @@ int parseargs(char **argv, int *cmds, int *stdin_redir, int *stdout_redir)
             cmdindex++;
             cmds[cmdindex] = argindex;
             stdin_redir[cmdindex] = -1;
-            stdout_redir[cmdindex] = -1;
+            outs[cmdindex].n = 0;
+            here[cmdindex] = 0;
+            co_in[cmdindex] = NULL;
         }
         argindex++;
     }
@@ -426,8 +1025,41 @@ int builtin_cmd(char **argv)
 {
     // printf("checking builtin cmd: %s\n", argv[0]);
     if (strcmp(argv[0], "quit") == 0) exit(0);
+    if (strcmp(argv[0], "true") == 0 || strcmp(argv[0], ":") == 0) {
+        last_status = 0;
+        return 1;
+    }
+    if (strcmp(argv[0], "false") == 0) {
+        last_status = 1;
+        return 1;
+    }
+    if (strcmp(argv[0], "test") == 0 || strcmp(argv[0], "[") == 0) {
+        last_status = do_test(argv);
+        return 1;
+    }
     if (strcmp(argv[0], "jobs") == 0) {
-        listjobs(jobs);
+        listjobs(jobs, argv[1] != NULL && strcmp(argv[1], "-l") == 0);
+        last_status = 0;
+        return 1;
+    }
+    if (strcmp(argv[0], "kill") == 0) {
+        last_status = do_kill(argv);
+        return 1;
+    }
+    if (strcmp(argv[0], "joblog") == 0) {
+        last_status = do_joblog(argv);
+        return 1;
+    }
+    if (strcmp(argv[0], "stats") == 0) {
+        last_status = do_stats(argv);
+        return 1;
+    }
+    if (strcmp(argv[0], "dag") == 0) {
+        last_status = do_dag(argv);
+        return 1;
+    }
+    if (strcmp(argv[0], "coproc") == 0) {
+        last_status = do_coproc(argv);
         return 1;
     }
     if (strcmp(argv[0], "fg") == 0 || strcmp(argv[0], "bg") == 0)
@@ -445,10 +1077,11 @@ void do_bgfg(char **argv)
 {
     sigset_t mask_all, prev_all;
 
-    sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+    sigfillset(&mask_all);
 
     char* cmd = argv[0];
     int state = 0;
+    last_status = 1; // until the job is resumed
     if (strcmp(cmd, "fg") == 0) state = FG; 
     else if (strcmp(cmd, "bg") == 0) state = BG;
 
@@ -476,103 +1109,5718 @@ void do_bgfg(char **argv)
         }
     }
 
+    sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+
     struct job_t* job;
     if ((job = getjobjid(jobs, jid)) == 0) {
         printf("%%%d: No such job\n", jid);
+        sigprocmask(SIG_SETMASK, &prev_all, NULL);
         return;
     }
 
+    // settings after the job re-pin its running processes
+    if (argv[2] != NULL) {
+        struct jobopts_t opts;
+        memset(&opts, 0, sizeof(opts));
+        int n = parse_jobopts(argv + 2, &opts);
+        if (n >= 0 && argv[2 + n] != NULL)
+            printf("%s: unexpected argument %s\n", cmd, argv[2 + n]);
+        if (n < 0 || argv[2 + n] != NULL || repin_job(job, &opts) < 0) {
+            sigprocmask(SIG_SETMASK, &prev_all, NULL);
+            return;
+        }
+        merge_jobopts(&job->opts, &opts);
+        if (opts.has_timeout)
+            start_job_timer(job);
+    }
+
+    if (state == FG) give_terminal(job);
     if (job->state == ST) {
-        kill(-1*(job->pid),SIGCONT);
+        kill(-1*(job->pgid),SIGCONT);
     }
     updateJobState(jobs,job->pid,state);
+    if (state == BG) last_status = 0;
 
-    sigprocmask(SIG_BLOCK, &prev_all, NULL);
+    sigprocmask(SIG_SETMASK, &prev_all, NULL);
 
     if (state == FG) waitfg(job->pid);
     return;
 }
 
+/*
+ * do_kill - Execute the builtin kill [-SIG | -s SIG] %jid|pid ... which
+ *    signals whole jobs by %jid and single processes by PID (SIGTERM by
+ *    default). Returns the exit status.
+ */
+int do_kill(char **argv)
+{
+    static const struct { char *name; int sig; } signames[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT},
+        {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+        {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM},
+        {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP},
+        {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}, {NULL, 0}};
+    struct job_t *job;
+    char *name = NULL;
+    int sig = SIGTERM;
+    int i, status = 0;
+
+    argv++;
+    if (*argv != NULL && strcmp(*argv, "-s") == 0)
+        name = *++argv ? *argv++ : "";
+    else if (*argv != NULL && (*argv)[0] == '-')
+        name = *argv++ + 1;
+    if (name != NULL)
+    {
+        if (strncmp(name, "SIG", 3) == 0)
+            name += 3;
+        for (i = 0; signames[i].name != NULL; i++)
+            if (strcmp(name, signames[i].name) == 0)
+                break;
+        if (signames[i].name != NULL)
+            sig = signames[i].sig;
+        else if (isdigit((unsigned char)*name) && (sig = atoi(name)) < NSIG)
+            ;
+        else
+        {
+            printf("kill: %s: invalid signal\n", name);
+            return 2;
+        }
+    }
+    if (*argv == NULL)
+    {
+        printf("kill command requires PID or %%job id argument\n");
+        return 2;
+    }
+
+    for (; *argv != NULL; argv++)
+    {
+        if ((*argv)[0] == '%')
+        {
+            if ((job = getjobjid(jobs, atoi(*argv + 1))) == NULL)
+            {
+                printf("%s: No such job\n", *argv);
+                status = 1;
+            }
+            else if (kill(-job->pgid, sig) < 0)
+            {
+                printf("kill: %s: %s\n", *argv, strerror(errno));
+                status = 1;
+            }
+        }
+        else if (atoi(*argv) <= 0)
+        {
+            printf("kill: argument must be a PID or %%job id\n");
+            status = 1;
+        }
+        else if (kill(atoi(*argv), sig) < 0)
+        {
+            printf("(%s): No such process\n", *argv);
+            status = 1;
+        }
+    }
+    return status;
+}
+
 /* 
  * waitfg - Block until process pid is no longer the foreground process
  */
 void waitfg(pid_t pid)
 {
+    sigset_t mask, prev;
+    struct job_t *job;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    mask = prev;
+    sigdelset(&mask, SIGCHLD);
     while (fgpid(jobs) == pid)
     {
-        sleep(1);
+        wait_event(-1, &mask, 0);
     }
+
+    if (interactive)
+    {
+        /* keep the modes a stopped job left (an editor's raw mode, say)
+         * for fg, then take the terminal back for the prompt */
+        if ((job = getjobpid(jobs, pid)) != NULL && job->state == ST)
+        {
+            job->has_tmodes = (tcgetattr(STDIN_FILENO, &job->tmodes) == 0);
+        }
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
     return;
 }
 
-/*****************
- * Signal handlers
- *****************/
-
-/* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+/*
+ * init_terminal - If stdin is a terminal, wait until tsh is in the
+ *    foreground, put it in its own process group and take the terminal.
+ *    Foreground jobs are then given the terminal, so ctrl-c and ctrl-z
+ *    go from the tty driver straight to them.
  */
-void sigchld_handler(int sig)
+void init_terminal(void)
 {
-    sigset_t mask_all, prev_all;
+    if (!isatty(STDIN_FILENO))
+        return;
 
-    int child_pid;
-    int status;
-    while ((child_pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0)
-    {
-        if (child_pid == -1) {
-            perror("waitpid");
-            exit(EXIT_FAILURE);
-        }
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp()))
+        kill(-shell_pgid, SIGTTIN);
 
-        sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+    /* job control makes us write to the terminal from the background */
+    Signal(SIGTTOU, SIG_IGN);
+    Signal(SIGTTIN, SIG_IGN);
 
-        int jid = pid2jid(child_pid);
-        if (child_pid > 0) {
+    setpgid(0, 0); /* fails harmlessly if we already lead a session */
+    shell_pgid = getpgrp();
+    if (tcsetpgrp(STDIN_FILENO, shell_pgid) < 0 ||
+        tcgetattr(STDIN_FILENO, &shell_tmodes) < 0)
+        return;
+    interactive = 1;
+}
 
-            if (WIFEXITED(status)) {
-                // printf("Job [%d] (%d) terminated by signal %d\n",jid,child_pid,sig);
-                // fflush(stdout);
-            }
-            else if (WIFSIGNALED(status)) {
-                printf("Job [%d] (%d) terminated by signal %d\n",jid,child_pid,WTERMSIG(status));
-                fflush(stdout);
-            }
-            else if (WIFSTOPPED(status)) {
-                printf("Job [%d] (%d) stopped by signal %d\n",jid,child_pid, WSTOPSIG(status));
-                fflush(stdout);
-                
-                updateJobState(jobs, child_pid, ST);
-            }
-            else if (WIFCONTINUED(status)) {
-            }
+/*
+ * give_terminal - Make job the terminal's foreground process group,
+ *    restoring the modes it had when it was stopped.
+ */
+void give_terminal(struct job_t *job)
+{
+    if (!interactive)
+        return;
+    if (job->has_tmodes)
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &job->tmodes);
+    tcsetpgrp(STDIN_FILENO, job->pgid);
+}
 
+/***********************************************
+ * Job placement: CPU affinity, nice and limits
+ ***********************************************/
 
-            if (!WIFSTOPPED(status) && !WIFCONTINUED(status)) {
-                deletejob(jobs, child_pid);
-            }
+/* The resources `limit' knows, and how their values are written */
+static const struct
+{
+    char *name;   /* name in limit name=value */
+    int resource; /* RLIMIT_... */
+    char unit;    /* 'b' bytes (K/M/G/T), 's' seconds (s/m/h), 'n' count */
+} limit_names[] = {
+    {"mem", RLIMIT_AS, 'b'},
+    {"cpu", RLIMIT_CPU, 's'},
+    {"fsize", RLIMIT_FSIZE, 'b'},
+    {"stack", RLIMIT_STACK, 'b'},
+    {"core", RLIMIT_CORE, 'b'},
+    {"nofile", RLIMIT_NOFILE, 'n'},
+    {"nproc", RLIMIT_NPROC, 'n'},
+    {NULL, 0, 0}};
 
-            sigprocmask(SIG_BLOCK, &prev_all, NULL);
+/* parse_cpulist - Parse a CPU list such as 0-3,8 into set */
+static int parse_cpulist(const char *s, cpu_set_t *set)
+{
+    char *end;
+    long lo, hi;
 
+    CPU_ZERO(set);
+    do
+    {
+        lo = hi = strtol(s, &end, 10);
+        if (end == s || lo < 0)
+            return -1;
+        if (*end == '-')
+        {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo)
+                return -1;
         }
-    }
-    return;
+        if (hi >= CPU_SETSIZE)
+            return -1;
+        for (; lo <= hi; lo++)
+            CPU_SET(lo, set);
+        s = end + 1;
+    } while (*end == ',');
+    return *end == '\0' ? 0 : -1;
 }
 
-/* 
- * sigint_handler - The kernel sends a SIGINT to the shell whenver the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.  
- */
-void sigint_handler(int sig)
+/* parse_limit_value - Parse the value of a limit in the given unit */
+static int parse_limit_value(const char *s, char unit, rlim_t *value)
 {
-    int fgPid = fgpid(jobs);
-    if ( fgPid > 0) {
-        kill(-fgPid,SIGINT);
+    char *end;
+    double v;
+
+    if (strcmp(s, "unlimited") == 0)
+    {
+        *value = RLIM_INFINITY;
+        return 0;
+    }
+    v = strtod(s, &end);
+    if (end == s || v < 0)
+        return -1;
+    if (unit == 'b' && *end != '\0' && end[1] == '\0' && strchr("KMGT", toupper(*end)))
+    {
+        for (const char *u = "KMGT"; *u; u++)
+        {
+            v *= 1024;
+            if (*u == toupper(*end))
+                break;
+        }
+    }
+    else if (unit == 's' && *end != '\0' && end[1] == '\0' && strchr("smh", *end))
+        v *= (*end == 'h') ? 3600 : (*end == 'm') ? 60 : 1;
+    else if (*end != '\0')
+        return -1;
+    *value = (rlim_t)v;
+    return 0;
+}
+
+/* parse_duration - Parse a duration such as 30, 1.5m or 200ms into ms */
+static int parse_duration(const char *s, long long *ms)
+{
+    char *end;
+    double v = strtod(s, &end);
+
+    if (end == s || v <= 0)
+        return -1;
+    if (strcmp(end, "ms") == 0)
+        ;
+    else if (*end == '\0' || strcmp(end, "s") == 0)
+        v *= 1000;
+    else if (strcmp(end, "m") == 0)
+        v *= 60 * 1000;
+    else if (strcmp(end, "h") == 0)
+        v *= 3600 * 1000;
+    else if (strcmp(end, "d") == 0)
+        v *= 24 * 3600 * 1000;
+    else
+        return -1;
+    *ms = v < 1 ? 1 : (long long)v;
+    return 0;
+}
+
+/* add_limit - Parse name=value into o, replacing an earlier value */
+static int add_limit(struct jobopts_t *o, const char *arg)
+{
+    const char *eq = strchr(arg, '=');
+    rlim_t value;
+    int i, k;
+
+    for (i = 0; limit_names[i].name != NULL; i++)
+        if (strlen(limit_names[i].name) == (size_t)(eq - arg) &&
+            strncmp(limit_names[i].name, arg, eq - arg) == 0)
+            break;
+    if (limit_names[i].name == NULL)
+    {
+        printf("limit: %.*s: unknown resource\n", (int)(eq - arg), arg);
+        return -1;
+    }
+    if (parse_limit_value(eq + 1, limit_names[i].unit, &value) < 0 ||
+        strlen(arg) >= sizeof(o->limits[0].text))
+    {
+        printf("limit: %s: bad value\n", arg);
+        return -1;
+    }
+
+    for (k = 0; k < o->nlimits && o->limits[k].resource != limit_names[i].resource; k++)
+        ;
+    if (k == MAXLIMITS)
+        return -1;
+    if (k == o->nlimits)
+        o->nlimits++;
+    o->limits[k].resource = limit_names[i].resource;
+    o->limits[k].value = value;
+    strcpy(o->limits[k].text, arg);
+    return 0;
+}
+
+/*
+ * parse_jobopts - Parse the placement prefixes at the start of argv:
+ *        affinity CPULIST   run on the listed CPUs only, e.g. 0-3,8
+ *        nice [-n N]        run N (default 10) nicer than the shell
+ *        limit NAME=VALUE.. set soft resource limits, e.g. mem=2G cpu=60s
+ *        timeout [-k GRACE] DURATION
+ *                           SIGTERM the job after DURATION, and SIGKILL it
+ *                           GRACE (default 5s) later
+ *    Returns the number of words used, or -1 after printing an error.
+ */
+int parse_jobopts(char **argv, struct jobopts_t *o)
+{
+    char *end;
+    int i = 0, n;
+
+    while (argv[i] != NULL)
+    {
+        if (strcmp(argv[i], "affinity") == 0)
+        {
+            if (argv[i + 1] == NULL || strlen(argv[i + 1]) >= sizeof(o->cpulist) ||
+                parse_cpulist(argv[i + 1], &o->cpus) < 0)
+            {
+                printf("affinity: expected a CPU list such as 0-3,8\n");
+                return -1;
+            }
+            strcpy(o->cpulist, argv[i + 1]);
+            o->has_cpus = 1;
+            i += 2;
+        }
+        else if (strcmp(argv[i], "nice") == 0)
+        {
+            o->has_nice = 1;
+            o->nice = 10;
+            i++;
+            if (argv[i] != NULL && strcmp(argv[i], "-n") == 0)
+            {
+                if (argv[i + 1] == NULL ||
+                    ((o->nice = strtol(argv[i + 1], &end, 10)), *end != '\0' || end == argv[i + 1]))
+                {
+                    printf("nice: -n expects a number\n");
+                    return -1;
+                }
+                i += 2;
+            }
+        }
+        else if (strcmp(argv[i], "limit") == 0)
+        {
+            for (n = 0, i++; argv[i] != NULL && strchr(argv[i], '=') != NULL; i++, n++)
+                if (add_limit(o, argv[i]) < 0)
+                    return -1;
+            if (n == 0)
+            {
+                printf("limit: expected NAME=VALUE, e.g. mem=2G cpu=60s\n");
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "timeout") == 0)
+        {
+            o->grace_ms = GRACE_MS;
+            i++;
+            if (argv[i] != NULL && strcmp(argv[i], "-k") == 0)
+            {
+                if (argv[i + 1] == NULL || parse_duration(argv[i + 1], &o->grace_ms) < 0)
+                {
+                    printf("timeout: -k expects a duration such as 2s\n");
+                    return -1;
+                }
+                i += 2;
+            }
+            if (argv[i] == NULL || strlen(argv[i]) >= sizeof(o->timeout) ||
+                parse_duration(argv[i], &o->timeout_ms) < 0)
+            {
+                printf("timeout: expected a duration such as 30s, 1.5m or 200ms\n");
+                return -1;
+            }
+            strcpy(o->timeout, argv[i]);
+            o->has_timeout = 1;
+            i++;
+        }
+        else
+            break;
+    }
+    return i;
+}
+
+/* merge_jobopts - Let the settings in src override those in dst */
+void merge_jobopts(struct jobopts_t *dst, const struct jobopts_t *src)
+{
+    int k;
+
+    if (src->has_cpus)
+    {
+        dst->has_cpus = 1;
+        dst->cpus = src->cpus;
+        strcpy(dst->cpulist, src->cpulist);
+    }
+    if (src->has_nice)
+    {
+        dst->has_nice = 1;
+        dst->nice = src->nice;
+    }
+    for (k = 0; k < src->nlimits; k++)
+        add_limit(dst, src->limits[k].text);
+    if (src->has_timeout)
+    {
+        dst->has_timeout = 1;
+        dst->timeout_ms = src->timeout_ms;
+        dst->grace_ms = src->grace_ms;
+        strcpy(dst->timeout, src->timeout);
+    }
+}
+
+/*
+ * apply_jobopts - Apply the job's settings to the calling process. Run
+ *    in every child of a job between fork and exec.
+ */
+int apply_jobopts(const struct jobopts_t *o)
+{
+    struct rlimit rl;
+    int k;
+
+    if (o->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &o->cpus) < 0)
+    {
+        printf("affinity %s: %s\n", o->cpulist, strerror(errno));
+        return -1;
+    }
+    if (o->has_nice)
+    {
+        errno = 0;
+        if (nice(o->nice) == -1 && errno != 0)
+        {
+            printf("nice -n %d: %s\n", o->nice, strerror(errno));
+            return -1;
+        }
+    }
+    for (k = 0; k < o->nlimits; k++)
+    {
+        getrlimit(o->limits[k].resource, &rl);
+        rl.rlim_cur = o->limits[k].value;
+        if (setrlimit(o->limits[k].resource, &rl) < 0)
+        {
+            printf("limit %s: %s\n", o->limits[k].text, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * repin_job - Apply new settings to the running processes of a job. The
+ *    niceness is set for the whole process group; affinity (every thread)
+ *    and limits are set per process, found by scanning /proc for members
+ *    of the group.
+ */
+int repin_job(struct job_t *job, const struct jobopts_t *o)
+{
+    char path[64], stat[512];
+    char *p;
+    DIR *proc, *task;
+    struct dirent *de, *te;
+    struct rlimit rl;
+    pid_t pid, tid;
+    int pgrp, fd, n, k, failed = 0;
+
+    if (o->has_nice &&
+        setpriority(PRIO_PGRP, job->pgid, getpriority(PRIO_PROCESS, 0) + o->nice) < 0)
+    {
+        printf("nice -n %d: %s\n", o->nice, strerror(errno));
+        failed = 1;
+    }
+    if (!o->has_cpus && o->nlimits == 0)
+        return failed ? -1 : 0;
+
+    if ((proc = opendir("/proc")) == NULL)
+    {
+        printf("/proc: %s\n", strerror(errno));
+        return -1;
+    }
+    while ((de = readdir(proc)) != NULL)
+    {
+        if ((pid = atoi(de->d_name)) <= 0)
+            continue;
+        /* the group is the fifth field, after "pid (comm) state ppid" */
+        sprintf(path, "/proc/%d/stat", pid);
+        if ((fd = open(path, O_RDONLY)) < 0)
+            continue;
+        n = read(fd, stat, sizeof(stat) - 1);
+        close(fd);
+        if (n <= 0)
+            continue;
+        stat[n] = '\0';
+        if ((p = strrchr(stat, ')')) == NULL ||
+            sscanf(p + 1, " %*c %*d %d", &pgrp) != 1 || pgrp != job->pgid)
+            continue;
+
+        if (o->has_cpus)
+        {
+            sprintf(path, "/proc/%d/task", pid);
+            if ((task = opendir(path)) != NULL)
+            {
+                while ((te = readdir(task)) != NULL)
+                    if ((tid = atoi(te->d_name)) > 0 &&
+                        sched_setaffinity(tid, sizeof(cpu_set_t), &o->cpus) < 0 && !failed)
+                    {
+                        printf("affinity %s: %s\n", o->cpulist, strerror(errno));
+                        failed = 1;
+                    }
+                closedir(task);
+            }
+        }
+        for (k = 0; k < o->nlimits; k++)
+        {
+            if (prlimit(pid, o->limits[k].resource, NULL, &rl) < 0)
+                continue;
+            rl.rlim_cur = o->limits[k].value;
+            if (prlimit(pid, o->limits[k].resource, &rl, NULL) < 0 && !failed)
+            {
+                printf("limit %s: %s\n", o->limits[k].text, strerror(errno));
+                failed = 1;
+            }
+        }
+    }
+    closedir(proc);
+    return failed ? -1 : 0;
+}
+
+/* format_jobopts - Describe the settings for jobs -l */
+static void format_jobopts(const struct jobopts_t *o, char *buf)
+{
+    int k;
+
+    buf[0] = '\0';
+    if (o->has_cpus)
+        buf += sprintf(buf, " affinity=%s", o->cpulist);
+    if (o->has_nice)
+        buf += sprintf(buf, " nice=%d", o->nice);
+    for (k = 0; k < o->nlimits; k++)
+        buf += sprintf(buf, " %s", o->limits[k].text);
+    if (o->has_timeout)
+        buf += sprintf(buf, " timeout=%s", o->timeout);
+}
+
+/***************************
+ * End job placement
+ ***************************/
+
+/************************************
+ * Event loop, timer wheel and input
+ ************************************/
+
+static unsigned char inbuf[MAXLINE]; /* input read but not yet used */
+static int inlen = 0, inpos = 0;
+
+/* now_ms - Milliseconds on the monotonic clock */
+long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* set_ticking - Start or stop the timerfd's TICK_MS heartbeat */
+static void set_ticking(int on)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (on)
+    {
+        its.it_value.tv_nsec = TICK_MS * 1000000L;
+        its.it_interval = its.it_value;
+    }
+    timerfd_settime(timer_fd, 0, &its, NULL);
+}
+
+/*
+ * timer_place - Put a timer in the wheel slot for its expiry: level 0
+ *    holds the next 64 ticks one per slot, level 1 the next 64*64 ticks
+ *    64 per slot, and so on. Timers move down a level when the slot
+ *    they are in comes up (see wheel_tick).
+ */
+static void timer_place(struct wtimer *t)
+{
+    unsigned long delta = t->expires - wheel_now;
+    struct wtimer **slot;
+    int level = 0;
+
+    if ((long)delta < 0)
+        delta = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= 1UL << (WHEEL_BITS * (level + 1)))
+        level++;
+    slot = &wheel[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    t->next = *slot;
+    if (*slot != NULL)
+        (*slot)->pprev = &t->next;
+    *slot = t;
+    t->pprev = slot;
+}
+
+/* timer_unlink - Take a pending timer out of its slot */
+static void timer_unlink(struct wtimer *t)
+{
+    *t->pprev = t->next;
+    if (t->next != NULL)
+        t->next->pprev = t->pprev;
+    t->pprev = NULL;
+}
+
+/*
+ * timer_add - (Re)start a timer to call t->fn after ms milliseconds.
+ *    Callers block SIGCHLD, whose handler cancels the timers of jobs.
+ */
+void timer_add(struct wtimer *t, long long ms)
+{
+    long long ticks = (ms + TICK_MS - 1) / TICK_MS;
+
+    if (t->pprev != NULL)
+        timer_cancel(t);
+    if (ticks < 1)
+        ticks = 1;
+    if (ticks >= 1LL << (WHEEL_BITS * WHEEL_LEVELS))
+        ticks = (1LL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    t->expires = wheel_now + ticks;
+    timer_place(t);
+    if (ntimers++ == 0)
+        set_ticking(1);
+}
+
+/* timer_cancel - Stop a timer if it is pending */
+void timer_cancel(struct wtimer *t)
+{
+    if (t->pprev == NULL)
+        return;
+    timer_unlink(t);
+    if (--ntimers == 0)
+        set_ticking(0);
+}
+
+/*
+ * wheel_tick - Advance the wheel by one tick: when a level wraps around,
+ *    spread the next slot of the level above over the levels below, then
+ *    fire the timers in the current level 0 slot. Each tick costs O(1)
+ *    amortized, however many timers are pending.
+ */
+static void wheel_tick(void)
+{
+    struct wtimer *t, *next;
+    int level;
+
+    wheel_now++;
+    for (level = 1; level < WHEEL_LEVELS &&
+                    ((wheel_now >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) == 0;
+         level++)
+    {
+        t = wheel[level][(wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+        wheel[level][(wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK] = NULL;
+        for (; t != NULL; t = next)
+        {
+            next = t->next;
+            timer_place(t);
+        }
+    }
+
+    t = wheel[0][wheel_now & WHEEL_MASK];
+    wheel[0][wheel_now & WHEEL_MASK] = NULL;
+    for (; t != NULL; t = next)
+    {
+        next = t->next;
+        t->pprev = NULL;
+        if (--ntimers == 0)
+            set_ticking(0);
+        t->fn(t);
+    }
+}
+
+/* run_timers - Catch the wheel up with the ticks the timerfd counted */
+static void run_timers(int fd, uint32_t events)
+{
+    sigset_t mask_all, prev_all;
+    uint64_t ticks;
+
+    if (read(timer_fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+        return;
+    sigfillset(&mask_all);
+    sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+    while (ticks-- > 0 && ntimers > 0)
+        wheel_tick();
+    sigprocmask(SIG_SETMASK, &prev_all, NULL);
+}
+
+/*
+ * watch_fd - Have wait_event() call fn(fd, events) when fd has any of
+ *    events (EPOLLIN, EPOLLOUT), or change the events of a watched fd.
+ *    Returns -1 if fd can't be watched.
+ */
+int watch_fd(int fd, uint32_t events, watch_fn *fn)
+{
+    struct epoll_event ev;
+
+    if (fd < 0 || fd >= MAXFDS)
+        return -1;
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, watchers[fd] ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0)
+        return -1;
+    watchers[fd] = fn;
+    return 0;
+}
+
+/* unwatch_fd - Stop watching fd; call before closing it */
+void unwatch_fd(int fd)
+{
+    if (fd < 0 || fd >= MAXFDS || watchers[fd] == NULL)
+        return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    watchers[fd] = NULL;
+}
+
+/*
+ * init_events - Create the epoll set the shell sleeps in and the timerfd
+ *    behind the timer wheel. stdin joins the set only while the shell
+ *    waits for input; a regular file can't be polled and is always ready.
+ */
+void init_events(void)
+{
+    struct epoll_event ev;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create error");
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        unix_error("timerfd_create error");
+    if (watch_fd(timer_fd, EPOLLIN, run_timers) < 0)
+        unix_error("epoll_ctl error");
+
+    ev.events = EPOLLIN;
+    ev.data.fd = STDIN_FILENO;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+        stdin_pollable = 1;
+    }
+}
+
+/*
+ * wait_event - Sleep until stdin is readable (if want_stdin), a signal
+ *    arrives or timeout_ms (-1: no limit) passes, running the handlers
+ *    of watched fds (the timer wheel among them) meanwhile. Waiting for
+ *    input tops up the launcher pool and writes STATS_FILE first.
+ *    sigmask, if not NULL, is the signal mask while sleeping, as for
+ *    sigsuspend(). Returns 1 if stdin is readable, 0 if not, and -1 when
+ *    interrupted by a signal.
+ */
+int wait_event(int timeout_ms, const sigset_t *sigmask, int want_stdin)
+{
+    struct epoll_event ev[64];
+    int n, i, fd, ready = 0;
+
+    /* the shell is idle; forking launchers now keeps them off the
+     * path of the next command, and STATS_FILE is written */
+    if (want_stdin)
+    {
+        pool_refill();
+        stats_flush();
+    }
+    if (want_stdin && !stdin_pollable)
+        return 1;
+    /* a hung-up stdin would wake every wait, so it is only in the set
+     * while wanted */
+    if (want_stdin != stdin_watched)
+    {
+        ev[0].events = EPOLLIN;
+        ev[0].data.fd = STDIN_FILENO;
+        epoll_ctl(epfd, want_stdin ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, STDIN_FILENO, &ev[0]);
+        stdin_watched = want_stdin;
+    }
+
+    if ((n = epoll_pwait(epfd, ev, 64, timeout_ms, sigmask)) < 0)
+    {
+        if (errno != EINTR)
+            unix_error("epoll_wait error");
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        /* an earlier handler may have closed this one's fd */
+        if ((fd = ev[i].data.fd) == STDIN_FILENO)
+            ready = 1;
+        else if (watchers[fd] != NULL)
+            watchers[fd](fd, ev[i].events);
+    }
+    return ready;
+}
+
+/*
+ * read_line - Read one line from stdin into buf (at most MAXLINE - 1
+ *    bytes, newline included), waiting in the event loop. Returns NULL
+ *    at end of file.
+ */
+char *read_line(char *buf)
+{
+    unsigned char *nl;
+    int n, len;
+
+    for (;;)
+    {
+        nl = memchr(inbuf + inpos, '\n', inlen - inpos);
+        if (nl != NULL || inlen - inpos == MAXLINE - 1)
+        {
+            len = nl != NULL ? nl - (inbuf + inpos) + 1 : inlen - inpos;
+            memcpy(buf, inbuf + inpos, len);
+            buf[len] = '\0';
+            inpos += len;
+            return buf;
+        }
+        memmove(inbuf, inbuf + inpos, inlen - inpos);
+        inlen -= inpos;
+        inpos = 0;
+
+        if (wait_event(-1, NULL, 1) <= 0)
+            continue;
+        if ((n = read(STDIN_FILENO, inbuf + inlen, sizeof(inbuf) - 1 - inlen)) < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            app_error("read error");
+        }
+        if (n == 0)
+            return NULL;
+        inlen += n;
+    }
+}
+
+/*
+ * job_expired - Timer callback for a job's deadline: send SIGTERM (and
+ *    SIGCONT, in case it is stopped) to the process group, then SIGKILL
+ *    if it is still there after the grace period.
+ */
+static void job_expired(struct wtimer *t)
+{
+    struct job_t *job = t->arg;
+    long long left = job->deadline - now_ms();
+
+    if (job->pid == 0)
+        return;
+    if (left > 0) /* beyond the wheel's range when it was set */
+    {
+        timer_add(t, left);
+        return;
+    }
+    if (!job->timed_out)
+    {
+        job->timed_out = 1;
+        kill(-job->pgid, SIGTERM);
+        kill(-job->pgid, SIGCONT);
+        job->deadline = now_ms() + job->opts.grace_ms;
+        timer_add(t, job->opts.grace_ms);
+    }
+    else
+        kill(-job->pgid, SIGKILL);
+}
+
+/* start_job_timer - Give job a deadline timeout_ms from now */
+void start_job_timer(struct job_t *job)
+{
+    job->timed_out = 0;
+    job->deadline = now_ms() + job->opts.timeout_ms;
+    job->timer.fn = job_expired;
+    job->timer.arg = job;
+    timer_add(&job->timer, job->opts.timeout_ms);
+}
+
+/************************
+ * End event loop
+ ************************/
+
+/******************************************
+ * Captured output of background jobs
+ ******************************************/
+
+/*
+ * With JOBLOG set to a size (64k, 1M, ...), every background job writes
+ * its stdout and stderr into a pipe that tsh drains into a ring holding
+ * the last JOBLOG bytes. joblog %N shows the ring; once the job's output
+ * ends, its last JOBLOG_TAIL lines (default 10) are printed. All rings
+ * together stay within JOBLOG_MAX (default 64M): a job started past it
+ * gets what is left, possibly nothing, and its output is still drained
+ * so that it never blocks.
+ */
+
+/* joblog_size - Parse the size in the variable name, dflt if unset */
+static size_t joblog_size(const char *name, size_t dflt)
+{
+    char *s = getvar(name);
+    rlim_t v;
+
+    if (s == NULL || parse_limit_value(s, 'b', &v) < 0 || v == RLIM_INFINITY)
+        return dflt;
+    return v;
+}
+
+/*
+ * joblog_open - If JOBLOG is set, make the pipe and ring for the output
+ *    of a background job about to start. Its processes get wfd as stdout
+ *    and stderr. Returns NULL if output isn't captured.
+ */
+struct joblog_t *joblog_open(void)
+{
+    struct joblog_t *log;
+    size_t size = joblog_size("JOBLOG", 0);
+    size_t budget = joblog_size("JOBLOG_MAX", 64 << 20);
+    int fd[2];
+
+    if (size == 0)
+        return NULL;
+    if (pipe2(fd, O_CLOEXEC) < 0)
+        return NULL;
+    if (fd[0] >= MAXFDS || (log = calloc(1, sizeof(*log))) == NULL)
+    {
+        close(fd[0]);
+        close(fd[1]);
+        return NULL;
+    }
+    log->fd = fd[0];
+    log->wfd = fd[1];
+    log->size = joblog_mem < budget ? budget - joblog_mem : 0;
+    if (size < log->size)
+        log->size = size;
+    if (log->size > 0 && (log->buf = malloc(log->size)) == NULL)
+        log->size = 0;
+    joblog_mem += log->size;
+    return log;
+}
+
+/* joblog_free - Release a ring and its pipe */
+static void joblog_free(struct joblog_t *log)
+{
+    if (log->wfd >= 0)
+        close(log->wfd);
+    if (joblogs[log->fd] == log)
+    {
+        unwatch_fd(log->fd);
+        joblogs[log->fd] = NULL;
+    }
+    close(log->fd);
+    joblog_mem -= log->size;
+    free(log->buf);
+    free(log);
+}
+
+/* joblog_copy - Copy the bytes the ring holds, oldest first, into out */
+static size_t joblog_copy(struct joblog_t *log, char *out)
+{
+    size_t n = log->total < log->size ? log->total : log->size;
+    size_t start, first;
+
+    if (n == 0)
+        return 0;
+    start = (log->total - n) % log->size;
+    first = n < log->size - start ? n : log->size - start;
+    memcpy(out, log->buf + start, first);
+    memcpy(out + first, log->buf, n - first);
+    return n;
+}
+
+/*
+ * joblog_done - The job's output has ended: print its last lines and
+ *    free the ring.
+ */
+static void joblog_done(struct joblog_t *log)
+{
+    long tail = joblog_size("JOBLOG_TAIL", 10);
+    char *text;
+    size_t n, first, start;
+
+    if (tail > 0 && log->size > 0 && log->total > 0 &&
+        (text = malloc(log->size)) != NULL)
+    {
+        n = joblog_copy(log, text);
+        /* the oldest line may have lost its start to the ring */
+        first = 0;
+        if (log->total > n)
+            while (first < n && text[first++] != '\n')
+                ;
+        if (first == n)
+            first = 0;
+        for (start = n; start > first; start--)
+            if (text[start - 1] == '\n' && start < n && --tail == 0)
+                break;
+        if (line_shown)
+        {
+            printf("\r\033[K");
+            async_output = 1;
+        }
+        printf("Job [%d] (%d) output:\n", log->jid, log->pid);
+        fwrite(text + start, 1, n - start, stdout);
+        if (n > 0 && text[n - 1] != '\n')
+            printf("\n");
+        fflush(stdout);
+        free(text);
+    }
+    joblog_free(log);
+}
+
+/*
+ * joblog_ready - Drain what a job wrote into its ring, and echo it if
+ *    the job is in the foreground. One read per wakeup, so a flood from
+ *    one job can't starve the others.
+ */
+static void joblog_ready(int fd, uint32_t events)
+{
+    struct joblog_t *log = joblogs[fd];
+    struct job_t *job;
+    char buf[65536];
+    size_t pos, chunk;
+    ssize_t n;
+
+    if ((n = read(fd, buf, sizeof(buf))) <= 0)
+    {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+            joblog_done(log);
+        return;
+    }
+    if ((job = getjobpid(jobs, log->pid)) != NULL && job->state == FG)
+    {
+        fflush(stdout);
+        write(STDOUT_FILENO, buf, n);
+    }
+    for (pos = log->size > (size_t)n ? 0 : n - log->size; pos < (size_t)n; pos += chunk)
+    {
+        chunk = log->size - (log->total + pos) % log->size;
+        if (chunk > n - pos)
+            chunk = n - pos;
+        memcpy(log->buf + (log->total + pos) % log->size, buf + pos, chunk);
+    }
+    log->total += n;
+}
+
+/*
+ * joblog_start - Attach the ring to the job that now writes into it and
+ *    start draining the pipe.
+ */
+void joblog_start(struct joblog_t *log, struct job_t *job)
+{
+    close(log->wfd);
+    log->wfd = -1;
+    log->jid = job->jid;
+    log->pid = job->pid;
+    fcntl(log->fd, F_SETFL, O_NONBLOCK);
+    joblogs[log->fd] = log;
+    if (watch_fd(log->fd, EPOLLIN, joblog_ready) < 0)
+        joblog_free(log);
+}
+
+/* joblog_discard - Drop the ring of a job that didn't start */
+void joblog_discard(struct joblog_t *log)
+{
+    joblog_free(log);
+}
+
+/*
+ * do_joblog - Execute the builtin joblog %jid|pid, which prints the
+ *    captured output of a running job. Returns the exit status.
+ */
+int do_joblog(char **argv)
+{
+    struct joblog_t *log = NULL;
+    char *text;
+    size_t n;
+    int i, jid = 0;
+    pid_t pid = 0;
+
+    if (argv[1] == NULL)
+    {
+        printf("joblog command requires PID or %%job id argument\n");
+        return 2;
+    }
+    if (argv[1][0] == '%')
+        jid = atoi(argv[1] + 1);
+    else
+        pid = atoi(argv[1]);
+    for (i = 0; i < MAXFDS && log == NULL; i++)
+        if (joblogs[i] != NULL &&
+            (jid > 0 ? joblogs[i]->jid == jid : joblogs[i]->pid == pid))
+            log = joblogs[i];
+    if (log == NULL)
+    {
+        printf("%s: No captured output\n", argv[1]);
+        return 1;
+    }
+
+    if ((text = malloc(log->size + 1)) == NULL)
+        unix_error("malloc error");
+    n = joblog_copy(log, text);
+    if (log->total > n)
+        printf("(%llu earlier bytes dropped)\n", log->total - n);
+    fwrite(text, 1, n, stdout);
+    if (n > 0 && text[n - 1] != '\n')
+        printf("\n");
+    free(text);
+    return 0;
+}
+
+/******************************************
+ * End captured output
+ ******************************************/
+
+/******************************************
+ * Runtime statistics
+ ******************************************/
+
+/*
+ * tsh counts commands, forks, launcher hand-offs, exec failures, reaps
+ * and how jobs end, and keeps log-linear histograms (16 buckets per
+ * power of two, so within 1/16 of the true value) of how long stages
+ * take from fork (or hand-off to a launcher) to execve, from execve to
+ * their reap, and from entering the SIGCHLD handler to each reap. The
+ * last is how far into its batch a child is reaped, not how long after
+ * its exit: tsh never learns when a child exited. A stage writes the
+ * time it calls execve into a page it shares with tsh, so timing costs
+ * no system calls. stats shows it all; with STATS_FILE set, tsh also
+ * writes it in the Prometheus text format for node_exporter's textfile
+ * collector, at most every STATS_INTERVAL (default 15s) and only when
+ * something changed.
+ */
+
+static struct wtimer stats_timer;    /* fires when the next dump is due */
+static unsigned long long dumped_gen = ~0ULL; /* stats_gen() at the last dump */
+static long long dumped_at = 0;      /* now_ms() of the last dump */
+static long long dump_due = 0;       /* now_ms() when stats_timer's dump is due */
+
+/* now_ns - Nanoseconds on the monotonic clock */
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* hist_index - The bucket of value v */
+static int hist_index(unsigned long long v)
+{
+    int e;
+
+    if (v < 1ULL << HIST_SUB)
+        return v;
+    e = 63 - __builtin_clzll(v);
+    return ((e - HIST_SUB + 1) << HIST_SUB) +
+           ((v >> (e - HIST_SUB)) & ((1 << HIST_SUB) - 1));
+}
+
+/* hist_low - The smallest value in bucket i */
+static unsigned long long hist_low(int i)
+{
+    int e = (i >> HIST_SUB) + HIST_SUB - 1;
+
+    if (i < 1 << HIST_SUB)
+        return i;
+    return (unsigned long long)((1 << HIST_SUB) + (i & ((1 << HIST_SUB) - 1)))
+           << (e - HIST_SUB);
+}
+
+static void hist_add(struct hist_t *h, long long v)
+{
+    if (v < 0) /* clocks of different CPUs */
+        v = 0;
+    h->n[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if ((unsigned long long)v > h->max)
+        h->max = v;
+}
+
+/* hist_pct - The value p (0..1) of the way up, rounded up to its bucket */
+static unsigned long long hist_pct(const struct hist_t *h, double p)
+{
+    unsigned long long rank = p * h->count + 0.999999, seen = 0;
+    int i;
+
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < HIST_BUCKETS - 1; i++)
+        if ((seen += h->n[i]) >= rank)
+            return hist_low(i + 1) - 1 < h->max ? hist_low(i + 1) - 1 : h->max;
+    return h->max;
+}
+
+/* hist_below - How many values were less than v (exact at powers of 2) */
+static unsigned long long hist_below(const struct hist_t *h, unsigned long long v)
+{
+    unsigned long long n = 0;
+    int i, end = hist_index(v);
+
+    for (i = 0; i < end; i++)
+        n += h->n[i];
+    return n;
+}
+
+/* init_stats - Map the exec_slots stages report to */
+void init_stats(void)
+{
+    /* a memfd, so that launchers, which exec afresh, can map it too */
+    if ((slots_fd = memfd_create("tsh-slots", MFD_CLOEXEC)) >= 0 &&
+        ftruncate(slots_fd, NSLOTS * sizeof(struct exec_slot)) < 0)
+    {
+        close(slots_fd);
+        slots_fd = -1;
+    }
+    exec_slots = mmap(NULL, NSLOTS * sizeof(struct exec_slot), PROT_READ | PROT_WRITE,
+                      slots_fd >= 0 ? MAP_SHARED : MAP_SHARED | MAP_ANONYMOUS, slots_fd, 0);
+    if (exec_slots == MAP_FAILED)
+        exec_slots = NULL; /* counters still work, latencies don't */
+}
+
+/*
+ * stats_slot - Take a slot to time a stage about to start in, with
+ *    SIGCHLD blocked. Returns -1 if there is none free.
+ */
+int stats_slot(void)
+{
+    int s;
+
+    if (exec_slots == NULL)
+        return -1;
+    for (s = 0; s < NSLOTS && slot_pid[s] != 0; s++)
+        ;
+    if (s == NSLOTS)
+        return -1;
+    if (s >= nslots)
+        nslots = s + 1;
+    slot_pid[s] = -1;
+    exec_slots[s].exec_ns = 0;
+    exec_slots[s].failed = 0;
+    slot_start[s] = now_ns();
+    return s;
+}
+
+/*
+ * stats_started - Count a stage started with fork() or by a launcher
+ *    (handoff) and tie its slot to its pid; a pid < 0 gives it back.
+ */
+void stats_started(int slot, pid_t pid, int handoff)
+{
+    if (pid > 0)
+    {
+        if (handoff)
+            stats.handoffs++;
+        else
+            stats.forks++;
+    }
+    if (slot >= 0)
+        slot_pid[slot] = pid > 0 ? pid : 0;
+}
+
+/* stage_exec - In a stage: about to execve, or (failed) giving up */
+void stage_exec(int slot, int failed)
+{
+    if (slot < 0 || exec_slots == NULL)
+        return;
+    exec_slots[slot].exec_ns = now_ns();
+    exec_slots[slot].failed = failed;
+}
+
+/*
+ * stats_reaped - Count a child reaped by the SIGCHLD handler, which
+ *    started at chld_ns, and time the stage if it was one.
+ */
+void stats_reaped(pid_t pid, long long chld_ns)
+{
+    long long now = now_ns();
+    struct exec_slot *e;
+    int s;
+
+    stats.reaps++;
+    hist_add(&stats.chld_reap, now - chld_ns);
+    for (s = 0; s < nslots && slot_pid[s] != pid; s++)
+        ;
+    if (s == nslots)
+        return; /* a launcher, or started while the slots were full */
+    slot_pid[s] = 0;
+    while (nslots > 0 && slot_pid[nslots - 1] == 0)
+        nslots--;
+    e = &exec_slots[s];
+    if (e->failed)
+        stats.exec_failed++;
+    else if (e->exec_ns != 0)
+    {
+        hist_add(&stats.fork_exec, e->exec_ns - slot_start[s]);
+        hist_add(&stats.exec_exit, now - e->exec_ns);
+    }
+}
+
+/* stats_ended - Count how a job ended */
+void stats_ended(struct job_t *job, int status)
+{
+    if (job->timed_out)
+        stats.timed_out++;
+    else if (WIFSIGNALED(status))
+        stats.signaled++;
+    else
+        stats.exited++;
+}
+
+/* stats_gen - Changes whenever s does */
+static unsigned long long stats_gen(const struct stats_t *s)
+{
+    return s->builtins + s->externals + s->spawns + s->sigchlds + s->reaps + s->stopped;
+}
+
+/* stats_copy - Take a consistent copy of the counters */
+static void stats_copy(struct stats_t *s)
+{
+    sigset_t mask_all, prev_all;
+
+    sigfillset(&mask_all);
+    sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+    *s = stats;
+    sigprocmask(SIG_SETMASK, &prev_all, NULL);
+}
+
+/* prom_hist - Write h as a Prometheus histogram, in seconds if ns */
+static void prom_hist(FILE *f, const char *name, const char *help,
+                      const struct hist_t *h, int ns)
+{
+    int k;
+
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    if (ns)
+    {
+        /* 1us to 4.9h, by powers of 4 */
+        for (k = 10; k <= 44; k += 2)
+            fprintf(f, "%s_bucket{le=\"%.15g\"} %llu\n", name,
+                    (double)(1ULL << k) / 1e9, hist_below(h, 1ULL << k));
+        fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n",
+                name, h->count, name, h->sum / 1e9, name, h->count);
+    }
+    else
+    {
+        for (k = 1; k <= 1 << HIST_SUB; k *= 2)
+            fprintf(f, "%s_bucket{le=\"%d\"} %llu\n", name, k, hist_below(h, k + 1));
+        fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %llu\n%s_count %llu\n",
+                name, h->count, name, h->sum, name, h->count);
+    }
+}
+
+/* prom_counter - Write the header of a Prometheus counter */
+static void prom_counter(FILE *f, const char *name, const char *help)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+}
+
+/* write_prom - Write s in the Prometheus text format */
+static void write_prom(FILE *f, const struct stats_t *s)
+{
+    prom_counter(f, "tsh_commands_total", "Commands run, by kind.");
+    fprintf(f, "tsh_commands_total{kind=\"builtin\"} %llu\n", s->builtins);
+    fprintf(f, "tsh_commands_total{kind=\"external\"} %llu\n", s->externals);
+    prom_counter(f, "tsh_stages_started_total", "Processes started for jobs, by how.");
+    fprintf(f, "tsh_stages_started_total{via=\"fork\"} %llu\n", s->forks);
+    fprintf(f, "tsh_stages_started_total{via=\"launcher\"} %llu\n", s->handoffs);
+    prom_counter(f, "tsh_forks_total", "Calls to fork(), launchers included.");
+    fprintf(f, "tsh_forks_total %llu\n", s->forks + s->spawns);
+    prom_counter(f, "tsh_exec_failures_total", "Stages that never reached execve or whose execve failed.");
+    fprintf(f, "tsh_exec_failures_total %llu\n", s->exec_failed);
+    prom_counter(f, "tsh_jobs_ended_total", "Jobs that ended, by how.");
+    fprintf(f, "tsh_jobs_ended_total{state=\"exited\"} %llu\n", s->exited);
+    fprintf(f, "tsh_jobs_ended_total{state=\"signaled\"} %llu\n", s->signaled);
+    fprintf(f, "tsh_jobs_ended_total{state=\"timed_out\"} %llu\n", s->timed_out);
+    prom_counter(f, "tsh_job_stops_total", "Times a job was stopped.");
+    fprintf(f, "tsh_job_stops_total %llu\n", s->stopped);
+    prom_counter(f, "tsh_sigchld_total", "SIGCHLD batches handled.");
+    fprintf(f, "tsh_sigchld_total %llu\n", s->sigchlds);
+    prom_counter(f, "tsh_reaps_total", "Children reaped.");
+    fprintf(f, "tsh_reaps_total %llu\n", s->reaps);
+    prom_hist(f, "tsh_reaps_per_sigchld", "Children reaped per SIGCHLD batch.", &s->batch, 0);
+    prom_hist(f, "tsh_fork_exec_seconds", "Time from fork or launcher hand-off to execve.",
+              &s->fork_exec, 1);
+    prom_hist(f, "tsh_exec_exit_seconds", "Time from execve to reap.", &s->exec_exit, 1);
+    prom_hist(f, "tsh_sigchld_reap_seconds",
+              "Time from SIGCHLD (entering its handler) to reap.", &s->chld_reap, 1);
+}
+
+/*
+ * stats_dump - Replace STATS_FILE with the current numbers, by renaming
+ *    a file written next to it so the collector never reads half of one
+ */
+static void stats_dump(void)
+{
+    static struct stats_t snap;
+    static int failing = 0;
+    char *path = getvar("STATS_FILE");
+    char tmp[MAXLINE + 8];
+    FILE *f;
+    int err;
+
+    if (path == NULL || *path == '\0' || strlen(path) >= MAXLINE)
+        return;
+    stats_copy(&snap);
+    dumped_gen = stats_gen(&snap);
+    dumped_at = now_ms();
+    sprintf(tmp, "%s.tmp", path);
+    if ((f = fopen(tmp, "w")) != NULL)
+    {
+        write_prom(f, &snap);
+        if (fclose(f) == 0 && rename(tmp, path) == 0)
+        {
+            failing = 0;
+            return;
+        }
+        err = errno;
+        unlink(tmp);
+        errno = err;
+    }
+    if (!failing) /* once until it works again */
+    {
+        if (line_shown)
+        {
+            printf("\r\033[K");
+            async_output = 1;
+        }
+        printf("%s: %s\n", path, strerror(errno));
+        fflush(stdout);
+    }
+    failing = 1;
+}
+
+/* stats_due - Timer callback: write the dump stats_flush() put off */
+static void stats_due(struct wtimer *t)
+{
+    long long left = dump_due - now_ms();
+
+    if (left > 0) /* beyond the wheel's range when it was set */
+    {
+        timer_add(t, left);
+        return;
+    }
+    stats_dump();
+}
+
+/*
+ * stats_flush - While tsh is idle: write STATS_FILE if it is set and the
+ *    numbers changed, now or, if the last dump was less than
+ *    STATS_INTERVAL ago, when that is up
+ */
+void stats_flush(void)
+{
+    char *path = getvar("STATS_FILE"), *s;
+    long long every = 15000, left;
+    sigset_t mask, prev;
+
+    if (path == NULL || *path == '\0' || stats_timer.pprev != NULL ||
+        stats_gen(&stats) == dumped_gen)
+        return;
+    if ((s = getvar("STATS_INTERVAL")) != NULL && parse_duration(s, &every) < 0)
+        every = 15000;
+    if ((left = dumped_at + every - now_ms()) <= 0)
+        stats_dump();
+    else
+    {
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, &prev);
+        dump_due = dumped_at + every;
+        stats_timer.fn = stats_due;
+        timer_add(&stats_timer, left);
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+    }
+}
+
+/* fmt_ns - Write ns in the unit that suits it */
+static char *fmt_ns(char *buf, unsigned long long ns)
+{
+    if (ns < 1000)
+        sprintf(buf, "%lluns", ns);
+    else if (ns < 1000000)
+        sprintf(buf, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        sprintf(buf, "%.1fms", ns / 1e6);
+    else
+        sprintf(buf, "%.2fs", ns / 1e9);
+    return buf;
+}
+
+/* show_hist - One line of the stats table */
+static void show_hist(const char *name, const struct hist_t *h, int ns)
+{
+    static const double pcts[] = {0.5, 0.9, 0.99, 0.999};
+    char buf[32];
+    int i;
+
+    printf("%-14s %8llu", name, h->count);
+    for (i = 0; i < 4; i++)
+    {
+        if (ns)
+            printf(" %9s", h->count ? fmt_ns(buf, hist_pct(h, pcts[i])) : "-");
+        else
+            printf(" %9llu", h->count ? hist_pct(h, pcts[i]) : 0);
+    }
+    if (ns)
+        printf(" %9s\n", h->count ? fmt_ns(buf, h->max) : "-");
+    else
+        printf(" %9llu\n", h->max);
+}
+
+/*
+ * do_stats - Execute the builtin stats command: show the counters and
+ *    histograms, or with -r, start them over
+ */
+int do_stats(char **argv)
+{
+    static struct stats_t s;
+    sigset_t mask_all, prev_all;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-r") == 0)
+    {
+        sigfillset(&mask_all);
+        sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+        memset(&stats, 0, sizeof(stats));
+        dumped_gen = ~0ULL; /* the next flush writes the zeros */
+        sigprocmask(SIG_SETMASK, &prev_all, NULL);
+        return 0;
+    }
+    if (argv[1] != NULL)
+    {
+        printf("usage: stats [-r]\n");
+        return 2;
+    }
+
+    stats_copy(&s);
+    printf("commands: %llu builtin, %llu external\n", s.builtins, s.externals);
+    printf("stages: %llu forked, %llu by launchers (%llu launchers forked), %llu failed to exec\n",
+           s.forks, s.handoffs, s.spawns, s.exec_failed);
+    printf("jobs: %llu exited, %llu signaled, %llu timed out; %llu stops\n",
+           s.exited, s.signaled, s.timed_out, s.stopped);
+    printf("reaps: %llu in %llu SIGCHLD batches\n", s.reaps, s.sigchlds);
+    printf("%-14s %8s %9s %9s %9s %9s %9s\n", "", "count", "p50", "p90", "p99", "p99.9", "max");
+    show_hist("fork->exec", &s.fork_exec, 1);
+    show_hist("exec->exit", &s.exec_exit, 1);
+    show_hist("sigchld->reap", &s.chld_reap, 1);
+    show_hist("reaps/batch", &s.batch, 0);
+    return 0;
+}
+
+/******************************************
+ * End runtime statistics
+ ******************************************/
+
+/******************************************
+ * Starting job stages and the launcher pool
+ ******************************************/
+
+/*
+ * With LAUNCHERS=n, tsh keeps n launchers: processes forked ahead of
+ * time that wait on a socket. A command is handed to an idle launcher
+ * as a launch_t, its stdin/stdout/stderr and pipe ends going along as
+ * SCM_RIGHTS, and the launcher execs it at once, so the fork is no longer
+ * between the prompt and the exec. Launchers are tsh's children, which
+ * keeps job control unchanged, but each execs tsh -L afresh, so that an
+ * idle one holds none of the job table, trie, functions or histograms
+ * of the shell it was forked from. The pool is refilled while tsh waits
+ * for input, not while a foreground job runs and might need the CPU.
+ */
+
+/*
+ * pack_stage - Describe a stage of a job: its argv, the < and > files
+ *    (NULL if none; the caller sets out_append for >>) and the job's
+ *    command line for error messages. Returns -1 if it doesn't fit.
+ */
+int pack_stage(struct launch_t *l, char **argv, char *in, char *out, const char *cmdline)
+{
+    int n, len = 0;
+
+    l->argc = 0;
+    l->in_redir = l->out_redir = -1;
+    l->out_append = 0;
+    for (; *argv != NULL; argv++, l->argc++)
+    {
+        if (len + (n = strlen(*argv) + 1) > (int)sizeof(l->args))
+            return -1;
+        memcpy(l->args + len, *argv, n);
+        len += n;
+    }
+    if (in != NULL)
+    {
+        if (len + (n = strlen(in) + 1) > (int)sizeof(l->args))
+            return -1;
+        l->in_redir = len;
+        memcpy(l->args + len, in, n);
+        len += n;
+    }
+    if (out != NULL)
+    {
+        if (len + (n = strlen(out) + 1) > (int)sizeof(l->args))
+            return -1;
+        l->out_redir = len;
+        memcpy(l->args + len, out, n);
+        len += n;
+    }
+    l->len = len;
+    n = strcspn(cmdline, "\n");
+    memcpy(l->cmdline, cmdline, n);
+    l->cmdline[n] = '\0';
+    return 0;
+}
+
+/* redir_failed - In a stage: a < or > file couldn't be opened */
+static void redir_failed(struct launch_t *l, const char *path)
+{
+    printf("%s: %s\n", path, strerror(errno));
+    fflush(stdout);
+    stage_exec(l->slot, 1);
+    _exit(1);
+}
+
+/*
+ * start_stage - In a fresh child or a launcher, become the stage l
+ *    describes. fds[0..2] replace stdin, stdout and stderr, then come
+ *    the < and > files and last the pipe ends fds[3] and fds[4]; -1
+ *    leaves a descriptor alone. Never returns.
+ */
+void start_stage(struct launch_t *l, int *fds)
+{
+    char *argv[MAXARGS];
+    char *newenviron[] = {NULL};
+    int i, len = 0;
+
+    for (i = 0; i < l->argc && i < MAXARGS - 1; i++)
+    {
+        argv[i] = l->args + len;
+        len += strlen(argv[i]) + 1;
+    }
+    argv[i] = NULL;
+
+    // join the job's process group before exec, whichever of
+    // parent and child gets there first
+    setpgid(0, l->pgid);
+    if (interactive && l->fg)
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &job_mask, NULL);
+    for (i = 0; i < 3; i++)
+        if (fds[i] >= 0)
+            dup2(fds[i], i);
+    if (apply_jobopts(&l->opts) < 0)
+    {
+        stage_exec(l->slot, 1);
+        exit(126);
+    }
+
+    // handle stdin redirect
+    if (l->in_redir >= 0) {
+        FILE* in = fopen(l->args + l->in_redir, "r");
+        if (in == NULL)
+            redir_failed(l, l->args + l->in_redir);
+        dup2(fileno(in),fileno(stdin));
+        fclose(in);
+    }
+
+    // handle stdout redirect
+    if (l->out_redir >= 0) {
+        FILE* out = fopen(l->args + l->out_redir, l->out_append ? "a" : "w");
+        if (out == NULL)
+            redir_failed(l, l->args + l->out_redir);
+        dup2(fileno(out),fileno(stdout));
+        fclose(out);
+    }
+
+    // pipes between the stages of a pipeline
+    if (fds[3] >= 0)
+        dup2(fds[3], STDIN_FILENO);
+    if (fds[4] >= 0)
+        dup2(fds[4], STDOUT_FILENO);
+
+    stage_exec(l->slot, 0);
+    execve(argv[0], argv, newenviron);
+    stage_exec(l->slot, 1);
+    printf("%s: Command not found\n", l->cmdline);
+    exit(127);
+}
+
+/*
+ * launcher_main - Wait in a launcher (tsh -L) for a stage to become: its
+ *    socket is fd 3 and the memfd of exec_slots, if any, fd 4
+ */
+void launcher_main(void)
+{
+    int sock = 3;
+    struct launch_t l;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union
+    {
+        char buf[CMSG_SPACE(5 * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    int fds[5];
+    int i, n;
+
+    /* out of the way of the terminal's signals until it is a job */
+    setpgid(0, 0);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    exec_slots = mmap(NULL, NSLOTS * sizeof(struct exec_slot), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, 4, 0);
+    if (exec_slots == MAP_FAILED)
+        exec_slots = NULL;
+    close(4);
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &l;
+    iov.iov_len = sizeof(l);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (n != sizeof(l))
+        _exit(0); /* tsh let go of us */
+    close(sock);
+
+    /* the descriptors arrive in order for the slots l.fdmask names */
+    cm = CMSG_FIRSTHDR(&msg);
+    for (i = 0, n = 0; i < 5; i++)
+        fds[i] = (l.fdmask & (1 << i)) && cm != NULL ? ((int *)CMSG_DATA(cm))[n++] : -1;
+    start_stage(&l, fds);
+}
+
+/* launcher_spawn - Fork one more idle launcher. Returns -1 on failure */
+static int launcher_spawn(void)
+{
+    char *argv[] = {"tsh", interactive ? "-L1" : "-L0", NULL};
+    char *newenviron[] = {NULL};
+    int sv[2], sock, slots;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+    fflush(stdout);
+    if ((pid = fork()) == 0)
+    {
+        /* keep nothing of tsh's open but the socket, as fd 3, and the
+         * exec_slots memfd, as fd 4; the launcher starts with the mask
+         * its stages are to have */
+        sock = fcntl(sv[1], F_DUPFD, 5);
+        slots = slots_fd >= 0 ? fcntl(slots_fd, F_DUPFD, 5) : -1;
+        dup2(sock, 3);
+        if (slots < 0 || dup2(slots, 4) < 0)
+            close(4);
+        close_range(5, ~0U, 0);
+        sigprocmask(SIG_SETMASK, &job_mask, NULL);
+        execve("/proc/self/exe", argv, newenviron);
+        _exit(1);
+    }
+    close(sv[1]);
+    if (pid < 0)
+    {
+        close(sv[0]);
+        return -1;
+    }
+    pool[npool].pid = pid;
+    pool[npool].sock = sv[0];
+    npool++;
+    stats.spawns++;
+    return 0;
+}
+
+/*
+ * pool_refill - Bring the pool to LAUNCHERS idle launchers. Launchers
+ *    that are let go see their socket close and exit.
+ */
+void pool_refill(void)
+{
+    char *s = getvar("LAUNCHERS");
+    int want = s != NULL ? atoi(s) : 0;
+
+    if (want > MAXPOOL)
+        want = MAXPOOL;
+    while (npool > want && npool > 0)
+        close(pool[--npool].sock);
+    while (npool < want)
+        if (launcher_spawn() < 0)
+            break;
+}
+
+/*
+ * pool_launch - Hand stage l to an idle launcher. Returns its PID, or 0
+ *    if there is none and the caller has to fork.
+ */
+pid_t pool_launch(struct launch_t *l, int *fds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union
+    {
+        char buf[CMSG_SPACE(5 * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    int i, n = 0;
+
+    l->fdmask = 0;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = l;
+    iov.iov_len = sizeof(*l);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    cm = (struct cmsghdr *)ctl.buf;
+    for (i = 0; i < 5; i++)
+        if (fds[i] >= 0)
+        {
+            ((int *)CMSG_DATA(cm))[n++] = fds[i];
+            l->fdmask |= 1 << i;
+        }
+    if (n > 0)
+    {
+        msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+    }
+
+    while (npool > 0)
+    {
+        struct launcher_t *h = &pool[--npool];
+        int sent = sendmsg(h->sock, &msg, MSG_NOSIGNAL);
+
+        close(h->sock);
+        if (sent == (int)sizeof(*l))
+            return h->pid;
+        kill(h->pid, SIGKILL); /* reaped like any stray child */
+    }
+    return 0;
+}
+
+/******************************************
+ * End launcher pool
+ ******************************************/
+
+/******************************************
+ * Fan-out of a stage's output
+ ******************************************/
+
+/*
+ * cmd > a > b, cmd >> a > b and cmd > a | next give cmd's whole output
+ * to every file and to the next stage, as cmd | tee a b would, without
+ * the tee process or a copy through user space. The stage writes into a
+ * pipe of tsh's. Every sink has a pipe of the same size in tsh, and
+ * whenever all of those are empty, tee(2) duplicates what the stage has
+ * written into them (the last one takes it with splice(2)); each is then
+ * spliced into its file or into the next stage's pipe. A sink that can't
+ * keep up holds the stage back, as a pipe would. splice(2) can't write
+ * to an O_APPEND file, so a >> file is opened without it, at its end,
+ * nor to some files, such as /dev/full or those of /proc: these get
+ * their bytes with read(2) and write(2) instead.
+ * When the next stage goes away the fan-out ends and the stage gets
+ * SIGPIPE, as with tee; a file that fails is dropped with a message.
+ */
+
+static void fanout_ready(int fd, uint32_t events);
+
+/*
+ * fanout_open - Make the pipe a stage whose output is fanned out writes
+ *    into; the stage gets wfd as its stdout. Returns NULL on failure.
+ */
+struct fanout_t *fanout_open(void)
+{
+    struct fanout_t *f;
+    int fd[2];
+
+    if (pipe2(fd, O_CLOEXEC) < 0)
+        return NULL;
+    if (fd[0] >= MAXFDS || (f = calloc(1, sizeof(*f))) == NULL)
+    {
+        close(fd[0]);
+        close(fd[1]);
+        return NULL;
+    }
+    f->fd = fd[0];
+    f->wfd = fd[1];
+    return f;
+}
+
+/*
+ * fanout_add - Add fd as a sink: a file called name, or with name NULL
+ *    the write end of a pipe. The fan-out closes fd when it is done.
+ *    Returns -1 (and leaves fd alone) if it can't be added.
+ */
+int fanout_add(struct fanout_t *f, int fd, const char *name)
+{
+    int *buf = f->buf[f->n];
+    int size;
+
+    if (f->n == MAXOUTS + 1 || fd < 0 || fd >= MAXFDS)
+    {
+        errno = EMFILE;
+        return -1;
+    }
+    if (pipe2(buf, O_CLOEXEC) < 0)
+        return -1;
+    if (name != NULL && (f->name[f->n] = strdup(name)) == NULL)
+    {
+        close(buf[0]);
+        close(buf[1]);
+        return -1;
+    }
+    /* as big as the stage's pipe, so that it takes a whole tee() */
+    if ((size = fcntl(f->fd, F_GETPIPE_SZ)) > 0)
+        fcntl(buf[1], F_SETPIPE_SZ, size);
+    /* the stages started after this one mustn't hold it open */
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (name == NULL)
+        fanouts[fd] = f;
+    f->sink[f->n++] = fd;
+    f->live++;
+    return 0;
+}
+
+/*
+ * fanout_file - Open path as a > file (>> if append) and add it as a
+ *    sink. Prints why if it can't. Returns -1 then.
+ */
+int fanout_file(struct fanout_t *f, const char *path, int append)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC), 0666);
+
+    if (fd >= 0 && append)
+        lseek(fd, 0, SEEK_END);
+    if (fd < 0 || fanout_add(f, fd, path) < 0)
+    {
+        printf("%s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/* fanout_drop - Close sink i and its pipe */
+static void fanout_drop(struct fanout_t *f, int i)
+{
+    if (fanouts[f->sink[i]] == f)
+    {
+        unwatch_fd(f->sink[i]);
+        fanouts[f->sink[i]] = NULL;
+    }
+    close(f->sink[i]);
+    close(f->buf[i][0]);
+    close(f->buf[i][1]);
+    free(f->name[i]);
+    f->name[i] = NULL;
+    f->sink[i] = -1;
+    f->live--;
+}
+
+/* fanout_eof - Close the stage's pipe; the sinks may still have bytes to take */
+static void fanout_eof(struct fanout_t *f)
+{
+    if (f->watched)
+        unwatch_fd(f->fd);
+    fanouts[f->fd] = NULL;
+    close(f->fd);
+    f->fd = -1;
+    f->watched = 0;
+}
+
+/* fanout_free - Close everything a fan-out holds and free it */
+static void fanout_free(struct fanout_t *f)
+{
+    int i;
+
+    for (i = 0; i < f->n; i++)
+        if (f->sink[i] >= 0)
+            fanout_drop(f, i);
+    if (f->wfd >= 0)
+        close(f->wfd);
+    if (f->fd >= 0)
+        fanout_eof(f);
+    free(f);
+}
+
+/*
+ * fanout_round - Copy what the stage has written into the pipes of the
+ *    sinks, which are all empty: tee() into all but the last, which
+ *    splice() moves it into. Returns the bytes copied, 0 at end of file,
+ *    or -1 (errno EAGAIN if there was nothing to copy).
+ */
+static ssize_t fanout_round(struct fanout_t *f)
+{
+    ssize_t k = -1, n;
+    int i, last = f->n - 1;
+
+    while (f->sink[last] < 0)
+        last--;
+    for (i = 0; i <= last; i++)
+    {
+        if (f->sink[i] < 0)
+            continue;
+        if (i < last)
+            n = tee(f->fd, f->buf[i][1], k < 0 ? INT_MAX : k, SPLICE_F_NONBLOCK);
+        else
+            n = splice(f->fd, NULL, f->buf[i][1], NULL, k < 0 ? INT_MAX : k,
+                       SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+        if (k < 0 && n <= 0)
+            return n;
+        if (k >= 0 && n != k)
+        { /* the sinks would get different bytes */
+            errno = EIO;
+            return -1;
+        }
+        f->left[i] = k = n;
+    }
+    return k;
+}
+
+/*
+ * fanout_copy - Move what sink i has yet to take into it with read()
+ *    and write(), for a file splice() can't write to. Returns the bytes
+ *    written, or -1.
+ */
+static ssize_t fanout_copy(struct fanout_t *f, int i)
+{
+    char buf[65536];
+    ssize_t n, k, done;
+
+    n = read(f->buf[i][0], buf, f->left[i] < sizeof(buf) ? f->left[i] : sizeof(buf));
+    for (done = 0; done < n; done += k)
+        if ((k = write(f->sink[i], buf + done, n - done)) < 0)
+            return -1;
+    return n;
+}
+
+/*
+ * fanout_drain - Splice into each sink what it has yet to take. A full
+ *    pipe sink is watched until it has room. Returns 1 if some sink still
+ *    has bytes to take, 0 if none has, and -1 if the fan-out has to end
+ *    because the next stage has gone away.
+ */
+static int fanout_drain(struct fanout_t *f)
+{
+    ssize_t n;
+    int i, busy = 0;
+
+    for (i = 0; i < f->n; i++)
+    {
+        while (f->sink[i] >= 0 && f->left[i] > 0)
+        {
+            if (f->copy[i])
+                n = fanout_copy(f, i);
+            else
+                n = splice(f->buf[i][0], NULL, f->sink[i], NULL, f->left[i],
+                           SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+            if (n < 0 && errno == EINVAL && f->name[i] != NULL && !f->copy[i])
+                f->copy[i] = 1;
+            else if (n > 0)
+                f->left[i] -= n;
+            else if (n < 0 && errno == EAGAIN)
+                break;
+            else if (n < 0 && errno == EINTR)
+                continue;
+            else if (f->name[i] == NULL)
+                return -1;
+            else
+            {
+                if (line_shown)
+                {
+                    printf("\r\033[K");
+                    async_output = 1;
+                }
+                printf("%s: %s\n", f->name[i], n < 0 ? strerror(errno) : "Short write");
+                fflush(stdout);
+                fanout_drop(f, i);
+            }
+        }
+        if (f->sink[i] < 0)
+            continue;
+        if ((f->left[i] > 0) != f->blocked[i])
+        {
+            if (f->left[i] == 0)
+                unwatch_fd(f->sink[i]);
+            else if (watch_fd(f->sink[i], EPOLLOUT, fanout_ready) < 0)
+                return -1;
+            f->blocked[i] = f->left[i] > 0;
+        }
+        busy |= f->left[i] > 0;
+    }
+    return busy;
+}
+
+/*
+ * fanout_pump - Move the stage's output on: drain the sinks' pipes and,
+ *    each time they are all empty, copy in what the stage has written,
+ *    at most rounds times (until its pipe is empty if rounds < 0). The
+ *    stage's pipe is watched only while the sinks are empty. Frees the
+ *    fan-out once it is over.
+ */
+static void fanout_pump(struct fanout_t *f, int rounds)
+{
+    ssize_t n;
+    int busy;
+
+    for (;;)
+    {
+        if ((busy = fanout_drain(f)) < 0 || f->live == 0 || (f->fd < 0 && !busy))
+        {
+            fanout_free(f);
+            return;
+        }
+        if (f->fd < 0)
+            return; /* the stage is done, a sink still takes its last bytes */
+        if (busy || rounds-- == 0)
+            break;
+        if ((n = fanout_round(f)) < 0 && errno == EAGAIN)
+            break;
+        if (n == 0 || (n < 0 && errno != EINTR))
+            fanout_eof(f);
+    }
+    if (busy == f->watched)
+    {
+        if (busy)
+            unwatch_fd(f->fd);
+        else if (watch_fd(f->fd, EPOLLIN, fanout_ready) < 0)
+        {
+            fanout_free(f);
+            return;
+        }
+        f->watched = !busy;
+    }
+}
+
+/*
+ * fanout_ready - The stage has written more, or a full sink has room:
+ *    one round per wakeup, so that one fan-out can't starve the others.
+ */
+static void fanout_ready(int fd, uint32_t events)
+{
+    if (fanouts[fd] != NULL)
+        fanout_pump(fanouts[fd], 1);
+}
+
+/*
+ * fanout_start - The stage writes into the fan-out now: let go of the
+ *    write end and start copying.
+ */
+void fanout_start(struct fanout_t *f)
+{
+    close(f->wfd);
+    f->wfd = -1;
+    fanouts[f->fd] = f;
+    fanout_pump(f, 0);
+}
+
+/* fanout_discard - Drop the fan-out of a stage that didn't start */
+void fanout_discard(struct fanout_t *f)
+{
+    fanout_free(f);
+}
+
+/*
+ * fanout_settle - After a foreground job, copy on what its stages left
+ *    in their pipes, until each pipe is at EOF or empty, so that the
+ *    files are complete by the next prompt. Whatever a slow reader
+ *    can't take yet stays with the epoll loop, which watches its sink.
+ */
+void fanout_settle(void)
+{
+    int fd;
+
+    for (fd = 0; fd < MAXFDS; fd++)
+        if (fanouts[fd] != NULL && fanouts[fd]->fd == fd)
+            fanout_pump(fanouts[fd], -1);
+}
+
+/******************************************
+ * End fan-out
+ ******************************************/
+
+/*************************************************
+ * Interpreter for compound commands and functions
+ *************************************************/
+
+/*
+ * read_cmdline - Print a prompt (unless -p) and read one line from stdin,
+ *    with the line editor if it is on. Returns NULL at end of file.
+ */
+char *read_cmdline(char *buf, char *prompt_str)
+{
+    if (editing)
+        return edit_line(buf, prompt_str);
+    if (emit_prompt)
+    {
+        printf("%s", prompt_str);
+        fflush(stdout);
+    }
+    return read_line(buf);
+}
+
+/*
+ * firstword - Copy the first space delimited word of s into w (cut to
+ *    size). Returns the offset in s of the end of the word.
+ */
+static int firstword(const char *s, char *w, int size)
+{
+    const char *p = s;
+    int i = 0;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+    for (; *p && *p != ' ' && *p != '\t'; p++)
+        if (i < size - 1)
+            w[i++] = *p;
+    w[i] = '\0';
+    return p - s;
+}
+
+/* oneword - Is s a single word, apart from surrounding blanks? */
+static int oneword(const char *s)
+{
+    while (*s == ' ' || *s == '\t')
+        s++;
+    while (*s && *s != ' ' && *s != '\t')
+        s++;
+    while (*s == ' ' || *s == '\t')
+        s++;
+    return *s == '\0';
+}
+
+/* iskeyword - Is w one of the NULL terminated list of keywords? */
+static int iskeyword(const char *w, const char **kws)
+{
+    for (; *kws != NULL; kws++)
+        if (strcmp(w, *kws) == 0)
+            return 1;
+    return 0;
+}
+
+static const char *openers[] = {"if", "for", "while", "until", "{", NULL};
+static const char *closers[] = {"fi", "done", "}", NULL};
+
+/* stmt_depth - How much a statement changes the block nesting depth */
+static int stmt_depth(const char *stmt)
+{
+    char w[MAXLINE];
+
+    firstword(stmt, w, MAXLINE);
+    if (iskeyword(w, openers))
+        return 1;
+    if (iskeyword(w, closers))
+        return -1;
+    return 0;
+}
+
+/* push_stmt - Append a copy of the (trimmed) statement to the list */
+static void push_stmt(struct stmts_t *st, const char *stmt, int len)
+{
+    static const char *leaders[] = {"if", "elif", "then", "else", "while",
+                                    "until", "do", "{", NULL};
+    char w[MAXLINE], hdr[MAXLINE], name[MAXLINE];
+    int lead, tlen, wlen, head, brace;
+
+    /* the text is kept as typed (eval() records it as the job's command
+     * line); only the structural checks look at the trimmed statement */
+    for (lead = 0; lead < len && (stmt[lead] == ' ' || stmt[lead] == '\t'); lead++)
+        ;
+    for (tlen = len; tlen > lead && (stmt[tlen - 1] == ' ' || stmt[tlen - 1] == '\t'); tlen--)
+        ;
+    if (tlen == lead || stmt[lead] == '#')
+        return;
+
+    /* keywords that may be followed by a command on the same line
+     * ("do echo hi", "if test ...") become statements of their own */
+    firstword(stmt + lead, w, MAXLINE);
+    wlen = strlen(w);
+    if (lead + wlen < tlen && iskeyword(w, leaders))
+    {
+        push_stmt(st, stmt + lead, wlen);
+        push_stmt(st, stmt + lead + wlen, len - lead - wlen);
+        return;
+    }
+    /* "name() {" and "function name {" open the function body on the
+     * same line, with or without a first command after the {; a { after
+     * any other command is just an argument */
+    head = lead + wlen;
+    if (strcmp(w, "function") == 0)
+        head += firstword(stmt + head, name, MAXLINE);
+    else if (wlen <= 2 || strcmp(w + wlen - 2, "()") != 0)
+        head = 0;
+    for (brace = head; brace > 0 && brace < tlen && (stmt[brace] == ' ' || stmt[brace] == '\t'); brace++)
+        ;
+    if (brace > head && brace < tlen && stmt[brace] == '{' &&
+        (brace + 1 == tlen || stmt[brace + 1] == ' ' || stmt[brace + 1] == '\t') &&
+        head - lead < MAXLINE)
+    {
+        memcpy(hdr, stmt + lead, head - lead);
+        hdr[head - lead] = '\0';
+        if (funcname(hdr, name))
+        {
+            push_stmt(st, stmt, head);
+            push_stmt(st, stmt + head, len - head);
+            return;
+        }
+    }
+
+    if (st->n == st->cap)
+    {
+        st->cap = st->cap ? 2 * st->cap : 16;
+        if ((st->s = realloc(st->s, st->cap * sizeof(char *))) == NULL)
+            unix_error("realloc error");
+    }
+    st->s[st->n] = strndup(stmt, len);
+    st->n++;
+}
+
+/*
+ * split_stmts - Break text into statements at ';' and newlines, outside
+ *    of single quotes, and append them to st.
+ */
+void split_stmts(const char *text, struct stmts_t *st)
+{
+    const char *start = text;
+    const char *p;
+    int quoted = 0;
+
+    for (p = text; *p; p++)
+    {
+        if (*p == '\'')
+            quoted = !quoted;
+        else if (!quoted && (*p == ';' || *p == '\n'))
+        {
+            push_stmt(st, start, p - start);
+            start = p + 1;
+        }
+    }
+    push_stmt(st, start, p - start);
+}
+
+/* free_stmts - Release a statement list */
+void free_stmts(struct stmts_t *st)
+{
+    int i;
+
+    for (i = 0; i < st->n; i++)
+        free(st->s[i]);
+    free(st->s);
+    st->s = NULL;
+    st->n = st->cap = 0;
+}
+
+/*
+ * run_line - Evaluate a line typed at the prompt. If it opens a compound
+ *    command (if, for, while, until or a function body) keep reading
+ *    lines until every block is closed, then run the statements. The
+ *    lines of here-documents are read as they come up.
+ */
+void run_line(char *cmdline)
+{
+    struct stmts_t st = {NULL, 0, 0};
+    char buf[MAXLINE];
+    char name[MAXLINE];
+    int depth = 0;
+    int i, from = 0;
+
+    split_stmts(cmdline, &st);
+    read_heredocs(&st, 0);
+    for (;;)
+    {
+        for (i = from; i < st.n; i++)
+            depth += stmt_depth(st.s[i]);
+        /* a function header on its own still waits for its { body } */
+        if (depth <= 0 && (st.n == 0 || !funcname(st.s[st.n - 1], name)))
+            break;
+        if (read_cmdline(buf, "> ") == NULL)
+        {
+            printf("syntax error: unexpected end of file\n");
+            free_stmts(&st);
+            return;
+        }
+        from = st.n;
+        split_stmts(buf, &st);
+        read_heredocs(&st, from);
+    }
+
+    if (depth < 0)
+    {
+        printf("syntax error: unexpected end of block\n");
+        last_status = 2;
+    }
+    else
+        exec_stmts(st.s, 0, st.n);
+    free_stmts(&st);
+}
+
+/*
+ * next_kw - Return the index of the first statement in s[from..hi) at
+ *    nesting depth 0 that starts with one of kws, or -1.
+ */
+static int next_kw(char **s, int from, int hi, const char **kws)
+{
+    char w[MAXLINE];
+    int depth = 0;
+    int i;
+
+    for (i = from; i < hi; i++)
+    {
+        firstword(s[i], w, MAXLINE);
+        if (depth == 0 && iskeyword(w, kws))
+            return i;
+        depth += stmt_depth(s[i]);
+        if (depth < 0)
+            return -1;
+    }
+    return -1;
+}
+
+/* syntax_error - Report a malformed compound command */
+static int syntax_error(const char *near)
+{
+    printf("syntax error near '%s'\n", near);
+    last_status = 2;
+    return FLOW_ERROR;
+}
+
+/*
+ * exec_if - Run the if statement at s[i]; *end is set to its fi.
+ */
+static int exec_if(char **s, int i, int hi, int *end)
+{
+    static const char *kw_then[] = {"then", NULL};
+    static const char *kw_branch[] = {"elif", "else", "fi", NULL};
+    static const char *kw_fi[] = {"fi", NULL};
+    char w[MAXLINE];
+    int cond, then, k, flow;
+    int taken = 0;
+
+    flow = FLOW_NEXT;
+    cond = i;
+    for (;;)
+    {
+        /* s[cond] is an "if" or "elif" whose test runs up to "then" */
+        if ((then = next_kw(s, cond + 1, hi, kw_then)) < 0)
+            return syntax_error(s[cond]);
+        if (!taken && (flow = exec_stmts(s, cond + 1, then)) != FLOW_NEXT)
+            return flow;
+        if ((k = next_kw(s, then + 1, hi, kw_branch)) < 0)
+            return syntax_error(s[then]);
+        if (!taken && last_status == 0)
+        {
+            taken = 1;
+            flow = exec_stmts(s, then + 1, k);
+        }
+        firstword(s[k], w, MAXLINE);
+        if (strcmp(w, "elif") == 0)
+        {
+            cond = k;
+            continue;
+        }
+        if (strcmp(w, "else") == 0)
+        {
+            int fi = next_kw(s, k + 1, hi, kw_fi);
+            if (fi < 0)
+                return syntax_error(s[k]);
+            if (!taken)
+                flow = exec_stmts(s, k + 1, fi);
+            k = fi;
+        }
+        *end = k;
+        return flow;
+    }
+}
+
+static int next_word(const char **p, char *word, int *quoted);
+
+/*
+ * exec_loop - Run the for, while or until statement at s[i]; *end is
+ *    set to its done.
+ */
+static int exec_loop(char **s, int i, int hi, int *end)
+{
+    static const char *kw_do[] = {"do", NULL};
+    static const char *kw_done[] = {"done", NULL};
+    char kw[MAXLINE];
+    int body, done, flow = FLOW_NEXT;
+
+    firstword(s[i], kw, MAXLINE);
+    if ((body = next_kw(s, i + 1, hi, kw_do)) < 0)
+        return syntax_error(s[i]);
+    if ((done = next_kw(s, body + 1, hi, kw_done)) < 0)
+        return syntax_error(s[body]);
+    *end = done;
+
+    nloops++;
+    if (strcmp(kw, "for") == 0)
+    {
+        /* for NAME [in WORD ...]: without in, over $1 $2 ...; a word
+         * that expands to nothing is dropped, one in quotes is taken as
+         * it is */
+        char name[MAXLINE], word[MAXLINE], expanded[MAXLINE];
+        char list[MAXLINE];
+        char *argv[MAXARGS];
+        const char *p = s[i];
+        int argc = 0, len = 0, quoted, n;
+        char *tok;
+
+        next_word(&p, word, &quoted); /* for */
+        if (next_word(&p, name, &quoted) == 0 ||
+            (next_word(&p, word, &quoted) > 0 && (quoted || strcmp(word, "in") != 0)))
+        {
+            nloops--;
+            return syntax_error(s[i]);
+        }
+        if (strcmp(word, "in") != 0)
+            for (n = 1; n < nposargs && argc < MAXARGS - 1; n++)
+                argv[argc++] = posargs[n];
+        while (next_word(&p, word, &quoted) > 0)
+        {
+            if (quoted)
+                strcpy(expanded, word);
+            else if (expand_text(word, expanded, MAXLINE, 0) < 0)
+            {
+                nloops--;
+                return syntax_error(s[i]);
+            }
+            tok = quoted ? expanded : strtok(expanded, " \t");
+            for (; tok != NULL && argc < MAXARGS - 1;
+                 tok = quoted ? NULL : strtok(NULL, " \t"))
+            {
+                if ((n = strlen(tok) + 1) > MAXLINE - len)
+                    break;
+                argv[argc++] = strcpy(list + len, tok);
+                len += n;
+            }
+            if (tok != NULL)
+            {
+                nloops--;
+                return syntax_error(s[i]);
+            }
+        }
+        argv[argc] = NULL;
+        for (int w = 0; w < argc; w++)
+        {
+            setvar(name, argv[w]);
+            flow = exec_stmts(s, body + 1, done);
+            if (flow == FLOW_BREAK || flow == FLOW_CONTINUE)
+            {
+                if (flow == FLOW_BREAK)
+                    break;
+                flow = FLOW_NEXT;
+            }
+            else if (flow != FLOW_NEXT)
+                break;
+        }
+    }
+    else
+    {
+        /* while/until TEST; do BODY; done */
+        int until = (strcmp(kw, "until") == 0);
+
+        for (;;)
+        {
+            if ((flow = exec_stmts(s, i + 1, body)) != FLOW_NEXT)
+                break;
+            if ((last_status == 0) == until)
+                break;
+            flow = exec_stmts(s, body + 1, done);
+            if (flow == FLOW_BREAK)
+                break;
+            if (flow == FLOW_CONTINUE)
+                flow = FLOW_NEXT;
+            else if (flow != FLOW_NEXT)
+                break;
+        }
+    }
+    nloops--;
+    if (flow == FLOW_BREAK || flow == FLOW_CONTINUE)
+        flow = FLOW_NEXT;
+    return flow;
+}
+
+/* getfunc - Find a shell function by name */
+static struct func_t *getfunc(const char *name)
+{
+    int i;
+
+    for (i = 0; i < MAXFUNCS; i++)
+        if (funcs[i].name != NULL && strcmp(funcs[i].name, name) == 0)
+            return &funcs[i];
+    return NULL;
+}
+
+/*
+ * define_func - Store the function defined by "name()" or "function name"
+ *    at s[i] whose body is the block that follows; *end is set to its }.
+ */
+static int define_func(char **s, int i, int hi, char *name, int *end)
+{
+    static const char *kw_close[] = {"}", NULL};
+    struct func_t *f;
+    struct body_t *body;
+    char w[MAXLINE];
+    int close, k;
+
+    if (i + 1 < hi)
+        firstword(s[i + 1], w, MAXLINE);
+    if (i + 1 >= hi || strcmp(w, "{") != 0)
+        return syntax_error(s[i]);
+    if ((close = next_kw(s, i + 2, hi, kw_close)) < 0)
+        return syntax_error(s[i + 1]);
+    *end = close;
+
+    if ((f = getfunc(name)) != NULL)
+    {
+        /* a function that redefines itself keeps running its old body,
+         * which the last call running it frees */
+        if (f->body->refs == 0)
+        {
+            free_stmts(&f->body->st);
+            free(f->body);
+        }
+    }
+    else
+    {
+        for (k = 0; k < MAXFUNCS && funcs[k].name != NULL; k++)
+            ;
+        if (k == MAXFUNCS)
+        {
+            printf("Tried to define too many functions\n");
+            last_status = 1;
+            return FLOW_NEXT;
+        }
+        f = &funcs[k];
+        f->name = strdup(name);
+    }
+    if ((body = calloc(1, sizeof(*body))) == NULL)
+        unix_error("calloc error");
+    for (k = i + 2; k < close; k++)
+        push_stmt(&body->st, s[k], strlen(s[k]));
+    f->body = body;
+    last_status = 0;
+    return FLOW_NEXT;
+}
+
+/*
+ * funcname - If stmt is a function header ("name()" or "function name"),
+ *    copy the function name into name and return 1.
+ */
+static int funcname(const char *stmt, char *name)
+{
+    char w[MAXLINE];
+    int len, end;
+
+    end = firstword(stmt, w, MAXLINE);
+    if (strcmp(w, "function") == 0)
+    {
+        firstword(stmt + end, name, MAXLINE);
+        return name[0] != '\0';
+    }
+    len = strlen(w);
+    if (len > 2 && strcmp(w + len - 2, "()") == 0 && oneword(stmt))
+    {
+        memcpy(name, w, len - 2);
+        name[len - 2] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * exec_stmts - Run the statements s[lo..hi). Returns one of the FLOW_
+ *    codes so that break, continue and return can unwind loops and calls.
+ */
+int exec_stmts(char **s, int lo, int hi)
+{
+    static const char *kw_if[] = {"if", NULL};
+    static const char *kw_loop[] = {"for", "while", "until", NULL};
+    char w[MAXLINE];
+    char name[MAXLINE];
+    int i, end, flow;
+
+    for (i = lo; i < hi; i++)
+    {
+        firstword(s[i], w, MAXLINE);
+        end = i;
+        if (iskeyword(w, kw_if))
+            flow = exec_if(s, i, hi, &end);
+        else if (iskeyword(w, kw_loop))
+            flow = exec_loop(s, i, hi, &end);
+        else if (funcname(s[i], name))
+            flow = define_func(s, i, hi, name, &end);
+        else if (stmt_depth(s[i]) != 0 || strcmp(w, "then") == 0 ||
+                 strcmp(w, "else") == 0 || strcmp(w, "elif") == 0 ||
+                 strcmp(w, "do") == 0)
+            flow = syntax_error(w);
+        else
+            flow = exec_simple(s[i]);
+        if (flow != FLOW_NEXT)
+            return flow;
+        i = end;
+    }
+    return FLOW_NEXT;
+}
+
+/* isname - Is the first len characters of s a valid variable name? */
+static int isname(const char *s, int len)
+{
+    int i;
+
+    if (len == 0 || !(isalpha((unsigned char)s[0]) || s[0] == '_'))
+        return 0;
+    for (i = 1; i < len; i++)
+        if (!(isalnum((unsigned char)s[i]) || s[i] == '_'))
+            return 0;
+    return 1;
+}
+
+/* isoperator - Is w a word parseargs() takes as a redirection or a pipe? */
+static int isoperator(const char *w)
+{
+    return strcmp(w, "|") == 0 || strcmp(w, "<") == 0 || strncmp(w, "<<", 2) == 0 ||
+           strncmp(w, "<&", 2) == 0 || strcmp(w, ">") == 0 || strcmp(w, ">>") == 0 ||
+           strncmp(w, ">&", 2) == 0;
+}
+
+/*
+ * exec_simple - Run one simple statement: a variable assignment, break,
+ *    continue, return, a call to a shell function, or a command line for
+ *    eval(). Builtins run inside eval() without forking.
+ */
+int exec_simple(char *stmt)
+{
+    char line[MAXLINE];
+    char first[MAXLINE];
+    char w[MAXLINE];
+    char *eq, *docs;
+    struct func_t *f;
+    int len;
+
+    /* the lines of its here-documents follow the first line */
+    if ((docs = strchr(stmt, '\n')) != NULL)
+    {
+        if (docs - stmt >= MAXLINE)
+        {
+            printf("Command line too long\n");
+            last_status = 1;
+            return FLOW_NEXT;
+        }
+        memcpy(first, stmt, docs - stmt);
+        first[docs - stmt] = '\0';
+        stmt = first;
+        docs++;
+    }
+
+    firstword(stmt, w, MAXLINE);
+    if ((eq = strchr(w, '=')) != NULL && isname(w, eq - w) && oneword(stmt))
+    {
+        /* NAME=value */
+        if (expand_line(eq + 1, line, MAXLINE) < 0)
+            return syntax_error(stmt);
+        w[eq - w] = '\0';
+        setvar(w, line);
+        last_status = 0;
+        return FLOW_NEXT;
+    }
+
+    if (expand_line(stmt, line, MAXLINE - 1) < 0)
+    {
+        printf("Command line too long\n");
+        last_status = 1;
+        return FLOW_NEXT;
+    }
+
+    firstword(line, w, MAXLINE);
+    if (strcmp(w, "break") == 0 || strcmp(w, "continue") == 0)
+    {
+        last_status = 0;
+        if (nloops == 0)
+            return FLOW_NEXT;
+        return w[0] == 'b' ? FLOW_BREAK : FLOW_CONTINUE;
+    }
+    if (strcmp(w, "return") == 0)
+    {
+        char *arg = strstr(line, w) + strlen(w);
+        if (*arg)
+            last_status = atoi(arg);
+        return ncalls > 0 ? FLOW_RETURN : FLOW_NEXT;
+    }
+
+    if ((f = getfunc(w)) != NULL)
+    {
+        char *argv[MAXARGS];
+        char argbuf[MAXLINE];
+        char **saveargs = posargs;
+        struct body_t *body = f->body;
+        int savenargs = nposargs;
+        int saveloops = nloops;
+        int flow, bg;
+
+        if (ncalls == MAXCALLS)
+        {
+            printf("%s: maximum function nesting exceeded\n", w);
+            last_status = 1;
+            return FLOW_ERROR;
+        }
+        /* parseline() reuses its buffer, so keep a private copy */
+        bg = parseline(strcat(line, "\n"), argv);
+        for (len = 1; argv[len] != NULL && !isoperator(argv[len]); len++)
+            ;
+        if (bg || argv[len] != NULL)
+        {
+            printf("%s: a function can't be redirected, piped or run in the background\n", w);
+            last_status = 1;
+            return FLOW_NEXT;
+        }
+        for (nposargs = 0, len = 0; argv[nposargs] != NULL; nposargs++)
+        {
+            strcpy(argbuf + len, argv[nposargs]);
+            argv[nposargs] = argbuf + len;
+            len += strlen(argbuf + len) + 1;
+        }
+        posargs = argv;
+        ncalls++;
+        body->refs++;
+        nloops = 0;
+        flow = exec_stmts(body->st.s, 0, body->st.n);
+        nloops = saveloops;
+        if (--body->refs == 0 && body != f->body)
+        {
+            free_stmts(&body->st);
+            free(body);
+        }
+        ncalls--;
+        posargs = saveargs;
+        nposargs = savenargs;
+        return flow == FLOW_ERROR ? FLOW_ERROR : FLOW_NEXT;
+    }
+
+    strcat(line, "\n");
+    heredoc_text = docs;
+    eval(line);
+    heredoc_text = NULL;
+    return FLOW_NEXT;
+}
+
+/*
+ * expand_line - Copy in to out replacing $NAME, ${NAME}, $1..$9, $#, $@,
+ *    $?, $$ and $! outside of single quotes. A reference that stands as a
+ *    word on its own and expands to nothing becomes '' so that it still
+ *    counts as an argument. Returns -1 if out would overflow.
+ */
+int expand_line(const char *in, char *out, int size)
+{
+    return expand_text(in, out, size, 1);
+}
+
+/*
+ * expand_text - expand_line(), or if not words, for text that isn't a
+ *    command line (a here-document): quotes are just characters there
+ *    and an empty expansion is nothing.
+ */
+int expand_text(const char *in, char *out, int size, int words)
+{
+    char name[MAXLINE];
+    char num[32];
+    const char *val;
+    const char *start;
+    int o = 0;
+    int quoted = 0;
+    int len;
+
+    while (*in)
+    {
+        if (*in == '\'' && words)
+            quoted = !quoted;
+        if (*in != '$' || quoted || in[1] == '\0')
+        {
+            if (o >= size - 1)
+                return -1;
+            out[o++] = *in++;
+            continue;
+        }
+
+        start = in++;
+        val = NULL;
+        if (*in == '{')
+        {
+            const char *close = strchr(in, '}');
+            if (close == NULL)
+                return -1;
+            len = close - in - 1;
+            memcpy(name, in + 1, len);
+            name[len] = '\0';
+            in = close + 1;
+            val = getvar(name);
+        }
+        else if (isdigit((unsigned char)*in))
+        {
+            int n = *in++ - '0';
+            val = (n == 0) ? "tsh" : (n < nposargs ? posargs[n] : "");
+        }
+        else if (*in == '#' || *in == '?' || *in == '$' || *in == '!')
+        {
+            int v = (*in == '#') ? (nposargs > 0 ? nposargs - 1 : 0)
+                  : (*in == '?') ? last_status
+                  : (*in == '$') ? getpid() : last_bg_pid;
+            sprintf(num, "%d", v);
+            val = num;
+            in++;
+        }
+        else if (*in == '@')
+        {
+            int i;
+            name[0] = '\0';
+            for (i = 1; i < nposargs; i++)
+            {
+                if (strlen(name) + strlen(posargs[i]) + 2 >= MAXLINE)
+                    return -1;
+                if (i > 1)
+                    strcat(name, " ");
+                strcat(name, posargs[i]);
+            }
+            val = name;
+            in++;
+        }
+        else
+        {
+            for (len = 0; isalnum((unsigned char)in[len]) || in[len] == '_'; len++)
+                ;
+            if (len == 0)
+            {
+                /* a lone '$' stands for itself */
+                in = start;
+                if (o >= size - 1)
+                    return -1;
+                out[o++] = *in++;
+                continue;
+            }
+            memcpy(name, in, len);
+            name[len] = '\0';
+            in += len;
+            val = getvar(name);
+        }
+
+        if (val == NULL)
+            val = "";
+        if (words && *val == '\0' && (o == 0 || out[o - 1] == ' ') &&
+            (*in == '\0' || *in == ' ' || *in == '\n'))
+            val = "''";
+        len = strlen(val);
+        if (o + len >= size - 1)
+            return -1;
+        memcpy(out + o, val, len);
+        o += len;
+    }
+    out[o] = '\0';
+    return o;
+}
+
+/* getvar - Return the value of a shell or environment variable, or NULL */
+char *getvar(const char *name)
+{
+    int i;
+
+    for (i = 0; i < MAXVARS; i++)
+        if (vars[i].name != NULL && strcmp(vars[i].name, name) == 0)
+            return vars[i].value;
+    return getenv(name);
+}
+
+/* setvar - Set a shell variable, creating it if needed */
+void setvar(const char *name, const char *value)
+{
+    int i, slot = -1;
+
+    for (i = 0; i < MAXVARS; i++)
+    {
+        if (vars[i].name != NULL && strcmp(vars[i].name, name) == 0)
+        {
+            free(vars[i].value);
+            vars[i].value = strdup(value);
+            return;
+        }
+        if (vars[i].name == NULL && slot < 0)
+            slot = i;
+    }
+    if (slot < 0)
+    {
+        printf("Tried to create too many variables\n");
+        return;
+    }
+    vars[slot].name = strdup(name);
+    vars[slot].value = strdup(value);
+}
+
+/*
+ * do_test - Execute the builtin test and [ commands. Supports string
+ *    (-z, -n, =, !=), integer (-eq, -ne, -lt, -le, -gt, -ge) and file
+ *    (-e, -f, -d) tests, optionally negated with !. Returns the status.
+ */
+int do_test(char **argv)
+{
+    struct stat sb;
+    int argc, negate = 0, result;
+
+    for (argc = 0; argv[argc] != NULL; argc++)
+        ;
+    if (strcmp(argv[0], "[") == 0)
+    {
+        if (strcmp(argv[argc - 1], "]") != 0)
+        {
+            printf("[: missing ]\n");
+            return 2;
+        }
+        argc--;
+    }
+    argv++, argc--;
+    if (argc > 0 && strcmp(argv[0], "!") == 0)
+    {
+        negate = 1;
+        argv++, argc--;
+    }
+
+    if (argc == 0)
+        result = 0;
+    else if (argc == 1)
+        result = argv[0][0] != '\0';
+    else if (argc == 2)
+    {
+        char *op = argv[0], *arg = argv[1];
+        if (strcmp(op, "-z") == 0)
+            result = arg[0] == '\0';
+        else if (strcmp(op, "-n") == 0)
+            result = arg[0] != '\0';
+        else if (strcmp(op, "-e") == 0)
+            result = stat(arg, &sb) == 0;
+        else if (strcmp(op, "-f") == 0)
+            result = stat(arg, &sb) == 0 && S_ISREG(sb.st_mode);
+        else if (strcmp(op, "-d") == 0)
+            result = stat(arg, &sb) == 0 && S_ISDIR(sb.st_mode);
+        else
+        {
+            printf("test: %s: unknown operator\n", op);
+            return 2;
+        }
+    }
+    else if (argc == 3)
+    {
+        char *op = argv[1];
+        long a = atol(argv[0]), b = atol(argv[2]);
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+            result = strcmp(argv[0], argv[2]) == 0;
+        else if (strcmp(op, "!=") == 0)
+            result = strcmp(argv[0], argv[2]) != 0;
+        else if (strcmp(op, "-eq") == 0)
+            result = a == b;
+        else if (strcmp(op, "-ne") == 0)
+            result = a != b;
+        else if (strcmp(op, "-lt") == 0)
+            result = a < b;
+        else if (strcmp(op, "-le") == 0)
+            result = a <= b;
+        else if (strcmp(op, "-gt") == 0)
+            result = a > b;
+        else if (strcmp(op, "-ge") == 0)
+            result = a >= b;
+        else
+        {
+            printf("test: %s: unknown operator\n", op);
+            return 2;
+        }
+    }
+    else
+    {
+        printf("test: too many arguments\n");
+        return 2;
+    }
+    return (result != negate) ? 0 : 1;
+}
+
+/********************
+ * End interpreter
+ ********************/
+
+/**********************************
+ * Here-documents and here-strings
+ **********************************/
+
+/*
+ * cmd <<WORD takes the lines that follow, up to one that is just WORD,
+ * as its stdin; <<-WORD drops their leading tabs and a quoted WORD
+ * ('EOF') leaves $ references in them alone. cmd <<< word takes word
+ * and a newline. run_line() reads the lines into the statement itself,
+ * after its first line, so loops and functions run a here-document as
+ * often as they like; eval() gets them in heredoc_text. The text goes
+ * into a pipe if it fits without blocking, otherwise into a memfd,
+ * either of which becomes the command's stdin: nothing on disk, nothing
+ * to clean up.
+ */
+
+#define DOC_STRIP 1  /* <<-: drop leading tabs */
+#define DOC_QUOTED 2 /* quoted word: no expansion */
+#define DOC_STRING 4 /* <<<: a here-string */
+
+/*
+ * next_word - Split off the next word of the first line of *p the way
+ *    parseline() does, a word that starts with a quote running to the
+ *    next quote. Returns its length (0 at the end), with *p advanced past
+ *    it and *quoted set if it was quoted.
+ */
+static int next_word(const char **p, char *word, int *quoted)
+{
+    const char *s = *p, *end;
+    int len;
+
+    while (*s == ' ' || *s == '\t')
+        s++;
+    if (*s == '\0' || *s == '\n')
+        return 0;
+    if ((*quoted = (*s == '\'')))
+    {
+        s++;
+        if ((end = strchr(s, '\'')) == NULL)
+            end = s + strcspn(s, "\n");
+    }
+    else
+        end = s + strcspn(s, " \t\n");
+    len = end - s < MAXLINE - 1 ? end - s : MAXLINE - 1;
+    memcpy(word, s, len);
+    word[len] = '\0';
+    *p = *end == '\'' ? end + 1 : end;
+    return len > 0 ? len : *quoted;
+}
+
+/*
+ * next_doc - Find the next <<, <<- or <<< in the first line of *p and
+ *    put its word in word (quotes removed) and what it is in *flags.
+ *    Returns 0 if there is none.
+ */
+static int next_doc(const char **p, char *word, int *flags)
+{
+    char tok[MAXLINE];
+    char *rest, *q;
+    int quoted;
+
+    while (next_word(p, tok, &quoted) > 0)
+    {
+        if (quoted || strncmp(tok, "<<", 2) != 0)
+            continue;
+        *flags = tok[2] == '<' ? DOC_STRING : tok[2] == '-' ? DOC_STRIP : 0;
+        rest = tok + (*flags ? 3 : 2);
+        if (*rest == '\0')
+        {
+            if (next_word(p, tok, &quoted) == 0)
+                return 0;
+            rest = tok;
+        }
+        else
+            quoted = 0;
+        /* <<'EOF', <<"EOF" or << "EOF" */
+        for (q = word; *rest; rest++)
+            if (*rest == '\'' || *rest == '"')
+                quoted = 1;
+            else
+                *q++ = *rest;
+        *q = '\0';
+        if (quoted)
+            *flags |= DOC_QUOTED;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * doc_line - Return the length of the line at s, newline included, and
+ *    set *end if it is the delimiter word (after <<-'s tabs).
+ */
+static int doc_line(const char *s, const char *word, int flags, int *end)
+{
+    int len = strcspn(s, "\n");
+    const char *t = s;
+
+    if (flags & DOC_STRIP)
+        while (*t == '\t')
+            t++;
+    *end = (int)strlen(word) == len - (t - s) && strncmp(t, word, len - (t - s)) == 0;
+    return s[len] == '\n' ? len + 1 : len;
+}
+
+/*
+ * read_heredocs - Read the lines of the here-documents of statements
+ *    from on in st, appending them to the statement they belong to
+ */
+void read_heredocs(struct stmts_t *st, int from)
+{
+    char word[MAXLINE];
+    char buf[MAXLINE];
+    const char *p;
+    size_t len, n, off;
+    int i, flags, end;
+
+    for (i = from; i < st->n; i++)
+    {
+        p = st->s[i];
+        while (next_doc(&p, word, &flags))
+        {
+            if (flags & DOC_STRING)
+                continue;
+            for (end = 0; !end;)
+            {
+                if (read_cmdline(buf, "> ") == NULL)
+                {
+                    printf("warning: here-document delimited by end-of-file (wanted `%s')\n", word);
+                    return;
+                }
+                doc_line(buf, word, flags, &end);
+                /* p points into the statement, which moves */
+                len = strlen(st->s[i]);
+                n = strlen(buf);
+                off = p - st->s[i];
+                if ((st->s[i] = realloc(st->s[i], len + n + 2)) == NULL)
+                    unix_error("realloc error");
+                p = st->s[i] + off;
+                if (st->s[i][len - 1] != '\n')
+                    st->s[i][len++] = '\n';
+                memcpy(st->s[i] + len, buf, n + 1);
+            }
+        }
+    }
+}
+
+/*
+ * doc_fd - Return a descriptor to read len bytes of data from: a pipe
+ *    if they fit in one without blocking, otherwise a memfd. -1 on error.
+ */
+static int doc_fd(const char *data, size_t len)
+{
+    int fd[2];
+    ssize_t n;
+    size_t off;
+
+    if (len <= PIPE_BUF)
+    {
+        if (pipe2(fd, O_CLOEXEC) < 0)
+            return -1;
+        if (len > 0 && write(fd[1], data, len) != (ssize_t)len)
+        {
+            close(fd[0]);
+            fd[0] = -1;
+        }
+        close(fd[1]);
+        return fd[0];
+    }
+    if ((fd[0] = memfd_create("tsh-heredoc", MFD_CLOEXEC)) < 0)
+        return -1;
+    for (off = 0; off < len; off += n)
+        if ((n = write(fd[0], data + off, len - off)) < 0)
+        {
+            close(fd[0]);
+            return -1;
+        }
+    lseek(fd[0], 0, SEEK_SET);
+    return fd[0];
+}
+
+/*
+ * open_heredocs - Open a descriptor for each here-document and
+ *    here-string of cmdline, in order, taking the lines of the
+ *    here-documents from text. Returns how many, or -1 on error with
+ *    none left open.
+ */
+int open_heredocs(const char *cmdline, const char *text, int *fds, int max)
+{
+    char word[MAXLINE];
+    char line[MAXLINE];
+    char out[MAXLINE];
+    char *data = NULL;
+    size_t len, cap = 0;
+    const char *p = cmdline;
+    int n = 0, flags, end, k, i;
+
+    while (next_doc(&p, word, &flags))
+    {
+        len = 0;
+        if (flags & DOC_STRING)
+        {
+            k = strlen(word);
+            if (len + k + 1 > cap && (data = realloc(data, cap = 2 * (len + k + 1))) == NULL)
+                unix_error("realloc error");
+            memcpy(data, word, k);
+            data[k] = '\n';
+            len = k + 1;
+        }
+        else
+        {
+            /* up to and past the delimiter */
+            for (end = 0; text != NULL && *text && !end; text += k)
+            {
+                const char *s = text;
+                k = doc_line(text, word, flags, &end);
+                if (end)
+                    continue;
+                if (flags & DOC_STRIP)
+                    while (*s == '\t')
+                        s++;
+                i = k - (s - text);
+                if (!(flags & DOC_QUOTED) && i < MAXLINE)
+                {
+                    memcpy(line, s, i);
+                    line[i] = '\0';
+                    if ((i = expand_text(line, out, MAXLINE, 0)) < 0)
+                        i = k - (s - text); /* too long to expand: as is */
+                    else
+                        s = out;
+                }
+                if (len + i > cap && (data = realloc(data, cap = 2 * (len + i))) == NULL)
+                    unix_error("realloc error");
+                memcpy(data + len, s, i);
+                len += i;
+            }
+        }
+        if (n == max || (fds[n] = doc_fd(data, len)) < 0)
+        {
+            printf("here-document: %s\n", n == max ? "too many" : strerror(errno));
+            while (n > 0)
+                close(fds[--n]);
+            free(data);
+            return -1;
+        }
+        n++;
+    }
+    free(data);
+    return n;
+}
+
+/*******************************************
+ * End here-documents and here-strings
+ *******************************************/
+
+/*********************
+ * Task graphs (dag)
+ *********************/
+
+/*
+ * dag [-j N] [-k] FILE runs the tasks of FILE as background jobs, each
+ * once the tasks it depends on have succeeded, at most N (default: the
+ * number of CPUs) at a time. A line of FILE reads
+ *
+ *     name [~estimate]: dependencies... : command
+ *
+ * with # starting a comment. Of the tasks that are ready, the one with
+ * the longest chain of estimates (default 1s each) still ahead of it
+ * starts first. The first failure stops the rest (SIGTERM, and SIGKILL
+ * GRACE_MS later), unless -k, which only skips what depends on it. Tasks are started from a reap
+ * hook's bookkeeping as soon as the SIGCHLD handler reaps what they
+ * waited for; at the end dag compares the time it took with the longest
+ * chain of dependent tasks as they actually ran.
+ */
+
+#define MAXTASKS 1024 /* max tasks in a dag file */
+
+/* Task states */
+#define T_WAIT 0 /* not started */
+#define T_RUN 1  /* running as a job */
+#define T_DONE 2 /* succeeded */
+#define T_FAIL 3 /* failed, or stopped after another one failed */
+#define T_SKIP 4 /* never ran: something it depends on failed */
+
+struct task_t
+{                         /* A task of a dag file */
+    char name[64];
+    char *cmd;            /* its command line */
+    char *depnames;       /* dependencies as written, until resolved */
+    int *deps;            /* the tasks it depends on */
+    int ndeps;
+    int waiting;          /* of those, how many haven't succeeded */
+    int state;            /* T_WAIT, T_RUN, ... */
+    long long est;        /* ms it is expected to take */
+    long long ahead;      /* ms of the longest chain of estimates from it */
+    pid_t pid;            /* while T_RUN */
+    long long start, end; /* now_ms() */
+    int status;           /* exit status */
+    long long path;       /* ms of the longest chain of actual runs to its end */
+    int prev;             /* the task before it on that chain, -1 if none */
+};
+
+static struct task_t *tasks;     /* the tasks of the dag being run */
+static int ntasks = 0;
+static int nrunning = 0;         /* tasks in T_RUN */
+static int dag_failed = 0;       /* if true, some task failed */
+static int dag_active = 0;       /* if true, a dag is running */
+static volatile sig_atomic_t dag_cancel = 0; /* ctrl-c during a dag */
+static struct wtimer dag_timer;  /* GRACE_MS after SIGTERM, for SIGKILL */
+static void (*dag_prev_hook)(struct job_t *job, int status);
+
+/* dag_find - Index of the task called name, or -1 */
+static int dag_find(const char *name)
+{
+    int i;
+
+    for (i = 0; i < ntasks; i++)
+        if (strcmp(tasks[i].name, name) == 0)
+            return i;
+    return -1;
+}
+
+static void dag_free(void)
+{
+    int i;
+
+    for (i = 0; i < ntasks; i++)
+    {
+        free(tasks[i].cmd);
+        free(tasks[i].depnames);
+        free(tasks[i].deps);
+    }
+    free(tasks);
+    tasks = NULL;
+    ntasks = 0;
+}
+
+/*
+ * dag_line - Add the task of one line of a dag file. Returns -1 if bad,
+ *    -2 if the name is too long.
+ */
+static int dag_line(char *line)
+{
+    struct task_t *t = &tasks[ntasks];
+    char *head = line, *deps, *cmd;
+    char est[32];
+    int n;
+
+    if ((deps = strchr(head, ':')) == NULL || (cmd = strchr(deps + 1, ':')) == NULL)
+        return -1;
+    *deps++ = '\0';
+    *cmd++ = '\0';
+    cmd += strspn(cmd, " \t");
+    memset(t, 0, sizeof(*t));
+    t->est = 1000;
+    n = strspn(head, " \t");
+    if (strcspn(head + n, " \t") >= sizeof(t->name))
+        return -2;
+    n = sscanf(head, "%63s %31s", t->name, est);
+    if (n < 1 || *cmd == '\0' || (n == 2 && (est[0] != '~' || parse_duration(est + 1, &t->est) < 0)))
+        return -1;
+    if (dag_find(t->name) >= 0)
+    {
+        printf("dag: task %s defined twice\n", t->name);
+        return -1;
+    }
+    if ((t->cmd = strdup(cmd)) == NULL || (t->depnames = strdup(deps)) == NULL ||
+        (t->deps = malloc(sizeof(int) * (strlen(deps) / 2 + 1))) == NULL)
+        unix_error("malloc error");
+    t->prev = -1;
+    ntasks++;
+    return 0;
+}
+
+/*
+ * dag_load - Read the tasks of path, resolve their dependencies and
+ *    find how much is ahead of each. Returns -1 (with a message) if the
+ *    file is bad or has a cycle.
+ */
+static int dag_load(const char *path)
+{
+    char line[MAXLINE];
+    char *p, *name, *save;
+    int order[MAXTASKS];
+    int i, k, d, lineno = 0, n = 0, more;
+    FILE *f;
+
+    if ((f = fopen(path, "r")) == NULL)
+    {
+        printf("dag: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if ((tasks = calloc(MAXTASKS, sizeof(struct task_t))) == NULL)
+        unix_error("calloc error");
+    while (fgets(line, MAXLINE, f) != NULL)
+    {
+        lineno++;
+        line[strcspn(line, "\n")] = '\0';
+        p = line + strspn(line, " \t");
+        if (*p == '\0' || *p == '#')
+            continue;
+        if (ntasks == MAXTASKS)
+        {
+            printf("dag: %s: more than %d tasks\n", path, MAXTASKS);
+            fclose(f);
+            return -1;
+        }
+        if ((k = dag_line(p)) < 0)
+        {
+            if (k == -2)
+                printf("dag: %s:%d: task name longer than %d characters\n", path, lineno,
+                       (int)sizeof(tasks->name) - 1);
+            else
+                printf("dag: %s:%d: expected name [~estimate]: dependencies : command\n",
+                       path, lineno);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+
+    for (i = 0; i < ntasks; i++)
+        for (name = strtok_r(tasks[i].depnames, " \t", &save); name != NULL;
+             name = strtok_r(NULL, " \t", &save))
+        {
+            if ((d = dag_find(name)) < 0)
+            {
+                printf("dag: %s depends on unknown task %s\n", tasks[i].name, name);
+                return -1;
+            }
+            tasks[i].deps[tasks[i].ndeps++] = d;
+        }
+
+    /* a task goes in order once all it depends on are in */
+    for (i = 0; i < ntasks; i++)
+        tasks[i].waiting = tasks[i].ndeps;
+    do
+    {
+        more = 0;
+        for (i = 0; i < ntasks; i++)
+        {
+            if (tasks[i].waiting != 0)
+                continue;
+            tasks[i].waiting = -1;
+            order[n++] = i;
+            more = 1;
+            for (k = 0; k < ntasks; k++)
+                for (d = 0; d < tasks[k].ndeps; d++)
+                    if (tasks[k].deps[d] == i)
+                        tasks[k].waiting--;
+        }
+    } while (more);
+    if (n < ntasks)
+    {
+        printf("dag: dependency cycle among:");
+        for (i = 0; i < ntasks; i++)
+            if (tasks[i].waiting > 0)
+                printf(" %s", tasks[i].name);
+        printf("\n");
+        return -1;
+    }
+
+    /* what is ahead of a task: itself and the most of any that need it */
+    for (i = 0; i < ntasks; i++)
+    {
+        tasks[i].ahead = tasks[i].est;
+        tasks[i].waiting = tasks[i].ndeps;
+    }
+    for (i = n - 1; i >= 0; i--)
+    {
+        struct task_t *t = &tasks[order[i]];
+        for (d = 0; d < t->ndeps; d++)
+            if (tasks[t->deps[d]].ahead < tasks[t->deps[d]].est + t->ahead)
+                tasks[t->deps[d]].ahead = tasks[t->deps[d]].est + t->ahead;
+    }
+    return 0;
+}
+
+/* dag_skip - Mark what depends on task i as never to run */
+static void dag_skip(int i)
+{
+    int k, d;
+
+    for (k = 0; k < ntasks; k++)
+        for (d = 0; d < tasks[k].ndeps; d++)
+            if (tasks[k].deps[d] == i && tasks[k].state == T_WAIT)
+            {
+                tasks[k].state = T_SKIP;
+                dag_skip(k);
+            }
+}
+
+/* dag_finish - Task i ended with status: update what depends on it */
+static void dag_finish(int i, int status)
+{
+    struct task_t *t = &tasks[i];
+    int k, d;
+
+    t->end = now_ms();
+    t->status = status;
+    if (t->state == T_RUN)
+        nrunning--;
+    if (status != 0)
+    {
+        t->state = T_FAIL;
+        dag_failed = 1;
+        dag_skip(i);
+        return;
+    }
+    t->state = T_DONE;
+    for (k = 0; k < ntasks; k++)
+        for (d = 0; d < tasks[k].ndeps; d++)
+            if (tasks[k].deps[d] == i)
+                tasks[k].waiting--;
+}
+
+/* dag_reaped - The reap hook while a dag runs */
+static void dag_reaped(struct job_t *job, int status)
+{
+    int i;
+
+    if (dag_prev_hook != NULL)
+        dag_prev_hook(job, status);
+    for (i = 0; i < ntasks; i++)
+        if (tasks[i].state == T_RUN && tasks[i].pid == job->pid)
+        {
+            dag_finish(i, job->timed_out ? 124
+                          : WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                          : WEXITSTATUS(status));
+            return;
+        }
+}
+
+/* dag_pick - The ready task with the most ahead of it, or -1 */
+static int dag_pick(void)
+{
+    int i, best = -1;
+
+    for (i = 0; i < ntasks; i++)
+        if (tasks[i].state == T_WAIT && tasks[i].waiting == 0 &&
+            (best < 0 || tasks[i].ahead > tasks[best].ahead))
+            best = i;
+    return best;
+}
+
+/* dag_start - Start task i as a background job */
+static void dag_start(int i)
+{
+    struct task_t *t = &tasks[i];
+    char stmt[MAXLINE + 2];
+
+    snprintf(stmt, sizeof(stmt), "%.*s &", MAXLINE - 1, t->cmd);
+    t->start = now_ms();
+    t->state = T_RUN;
+    nrunning++;
+    last_bg_pid = 0;
+    exec_simple(stmt);
+    if ((t->pid = last_bg_pid) == 0) /* a builtin or function: done already */
+        dag_finish(i, last_status);
+}
+
+/* dag_stop - Send sig to every running task */
+static void dag_stop(int sig)
+{
+    struct job_t *job;
+    int i;
+
+    for (i = 0; i < ntasks; i++)
+        if (tasks[i].state == T_RUN && (job = getjobpid(jobs, tasks[i].pid)) != NULL)
+        {
+            kill(-job->pgid, sig);
+            kill(-job->pgid, SIGCONT);
+        }
+}
+
+/* dag_kill - Timer callback: SIGKILL the tasks SIGTERM didn't stop */
+static void dag_kill(struct wtimer *t)
+{
+    dag_stop(SIGKILL);
+}
+
+/* dag_report - Print the failures, the outcome and the critical path */
+static void dag_report(long long began)
+{
+    int count[5] = {0, 0, 0, 0, 0};
+    int i, d, next, last = -1, n = 0, chain[MAXTASKS];
+    long long end = began;
+    struct task_t *t;
+
+    for (i = 0; i < ntasks; i++)
+    {
+        count[tasks[i].state]++;
+        if (tasks[i].state == T_FAIL)
+            printf("dag: %s failed with status %d\n", tasks[i].name, tasks[i].status);
+        if (tasks[i].state != T_WAIT && tasks[i].state != T_SKIP && tasks[i].end > end)
+            end = tasks[i].end;
+        tasks[i].path = -1;
+    }
+
+    /* in the order they ended, each task comes after what it needed */
+    for (;;)
+    {
+        for (i = 0, next = -1; i < ntasks; i++)
+            if (tasks[i].state == T_DONE && tasks[i].path < 0 &&
+                (next < 0 || tasks[i].end < tasks[next].end))
+                next = i;
+        if (next < 0)
+            break;
+        t = &tasks[next];
+        t->path = t->end - t->start;
+        for (d = 0; d < t->ndeps; d++)
+            if (tasks[t->deps[d]].path + t->end - t->start > t->path)
+            {
+                t->path = tasks[t->deps[d]].path + t->end - t->start;
+                t->prev = t->deps[d];
+            }
+        if (last < 0 || t->path > tasks[last].path)
+            last = next;
+    }
+
+    printf("dag: %d tasks: %d done, %d failed, %d not run; took %.2fs",
+           ntasks, count[T_DONE], count[T_FAIL], count[T_WAIT] + count[T_SKIP],
+           (end - began) / 1e3);
+    if (last >= 0)
+    {
+        printf(", critical path %.2fs (", tasks[last].path / 1e3);
+        for (i = last; i >= 0 && n < MAXTASKS; i = tasks[i].prev)
+            chain[n++] = i;
+        while (n-- > 0)
+            printf("%s%s", tasks[chain[n]].name, n > 0 ? " > " : ")");
+    }
+    printf("\n");
+}
+
+/*
+ * do_dag - Execute the builtin dag command. Returns 0 if every task
+ *    succeeded, 1 if not, 2 for a bad file or usage.
+ */
+int do_dag(char **argv)
+{
+    sigset_t mask, prev, waitmask;
+    long long began;
+    char *path = NULL;
+    int i, jmax = sysconf(_SC_NPROCESSORS_ONLN), keep_going = 0, stopping = 0, bad = 0;
+
+    for (i = 1; argv[i] != NULL && !bad; i++)
+    {
+        if (strcmp(argv[i], "-k") == 0)
+            keep_going = 1;
+        else if (strcmp(argv[i], "-j") == 0 && argv[i + 1] != NULL)
+            jmax = atoi(argv[++i]);
+        else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != '\0')
+            jmax = atoi(argv[i] + 2);
+        else if (path == NULL && argv[i][0] != '-')
+            path = argv[i];
+        else
+            bad = 1;
+    }
+    if (bad || path == NULL || jmax < 1)
+    {
+        printf("usage: dag [-j N] [-k] FILE\n");
+        return 2;
+    }
+    if (dag_active)
+    {
+        printf("dag: already running\n");
+        return 1;
+    }
+    if (dag_load(path) < 0)
+    {
+        dag_free();
+        return 2;
+    }
+
+    /* tasks start and end only here and in wait_event() */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    waitmask = prev;
+    sigdelset(&waitmask, SIGCHLD);
+    sigdelset(&waitmask, SIGINT);
+    dag_active = 1;
+    dag_cancel = 0;
+    dag_failed = 0;
+    nrunning = 0;
+    dag_prev_hook = reap_hook;
+    reap_hook = dag_reaped;
+
+    began = now_ms();
+    for (;;)
+    {
+        if (!stopping && (dag_cancel || (dag_failed && !keep_going)))
+        {
+            printf("dag: %s, stopping\n", dag_cancel ? "interrupted" : "a task failed");
+            stopping = 1;
+            dag_stop(SIGTERM);
+            dag_timer.fn = dag_kill;
+            timer_add(&dag_timer, GRACE_MS);
+        }
+        while (!stopping && nrunning < jmax && job_slot_free() && (i = dag_pick()) >= 0)
+            dag_start(i);
+        if (nrunning == 0)
+            break;
+        wait_event(-1, &waitmask, 0);
+    }
+
+    timer_cancel(&dag_timer);
+    reap_hook = dag_prev_hook;
+    dag_active = 0;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    dag_report(began);
+    dag_free();
+    return dag_failed || stopping ? 1 : 0;
+}
+
+/*********************
+ * End task graphs
+ *********************/
+
+/*********************
+ * Coprocesses
+ *********************/
+
+/*
+ * coproc NAME cmd starts cmd as a background job whose stdin and stdout
+ * are pipes to tsh. Later commands write to it with >&NAME and read from
+ * it with <&NAME, so a tool with a costly startup starts once for many
+ * requests. echo and read are builtins, so a request and its answer
+ * (echo q >&NAME; read r <&NAME) cost no fork at all. The coprocess is a
+ * job like any other for jobs, kill and fg. tsh keeps its ends of the
+ * pipes, and so what the coprocess wrote last, until coproc -c NAME or
+ * a new coprocess of that name. read takes a coprocess's output a buffer
+ * at a time: a command given <&NAME after a read doesn't see what read
+ * took but hasn't returned yet.
+ */
+
+struct coproc_t
+{                      /* A coprocess */
+    char name[32];     /* its NAME, "" if the slot is free */
+    pid_t pid;         /* its last process, 0 until it has started */
+    int in;            /* write end of its stdin */
+    int out;           /* read end of its stdout */
+    char buf[MAXLINE]; /* what read took from out but hasn't returned */
+    int pos, len;      /* unreturned bytes are buf[pos..len) */
+};
+
+static struct coproc_t coprocs[MAXCOPROCS];
+static volatile sig_atomic_t coproc_waiting = 0; /* read waits for a coprocess */
+static volatile sig_atomic_t coproc_cancel = 0;  /* ctrl-c while it waited */
+static int coproc_ready = 0;                     /* the fd it waits for is ready */
+
+/* coproc_find - The coprocess called name, or NULL */
+static struct coproc_t *coproc_find(const char *name)
+{
+    int i;
+
+    for (i = 0; i < MAXCOPROCS; i++)
+        if (coprocs[i].name[0] && strcmp(coprocs[i].name, name) == 0)
+            return &coprocs[i];
+    return NULL;
+}
+
+/* coproc_named - Like coproc_find, but says so if there is none */
+static struct coproc_t *coproc_named(const char *name)
+{
+    struct coproc_t *co = coproc_find(name);
+
+    if (co == NULL || co->pid == 0)
+    {
+        printf("%s: No such coprocess\n", name);
+        return NULL;
+    }
+    return co;
+}
+
+/* coproc_close - Close tsh's ends of the pipes and free the slot */
+static void coproc_close(struct coproc_t *co)
+{
+    close(co->in);
+    close(co->out);
+    co->name[0] = '\0';
+}
+
+/*
+ * coproc_open - Make the pipes for a coprocess called name. ends[0] is
+ *    to be its stdin and ends[1] its stdout. Returns NULL (and says why)
+ *    if there can't be one.
+ */
+struct coproc_t *coproc_open(const char *name, int *ends)
+{
+    struct coproc_t *co = coproc_find(name);
+    int in[2], out[2];
+
+    if (!isname(name, strlen(name)) || strlen(name) >= sizeof(co->name))
+    {
+        printf("coproc: %s: not a valid name\n", name);
+        return NULL;
+    }
+    if (co != NULL && getjobpid(jobs, co->pid) != NULL)
+    {
+        printf("coproc: %s: already running\n", name);
+        return NULL;
+    }
+    if (co != NULL)
+        coproc_close(co);
+    for (co = coprocs; co < coprocs + MAXCOPROCS && co->name[0]; co++)
+        ;
+    if (co == coprocs + MAXCOPROCS)
+    {
+        printf("coproc: too many coprocesses\n");
+        return NULL;
+    }
+    if (pipe2(in, O_CLOEXEC) < 0)
+    {
+        printf("coproc: %s\n", strerror(errno));
+        return NULL;
+    }
+    if (pipe2(out, O_CLOEXEC) < 0)
+    {
+        printf("coproc: %s\n", strerror(errno));
+        close(in[0]);
+        close(in[1]);
+        return NULL;
+    }
+    strcpy(co->name, name);
+    co->pid = 0;
+    co->in = in[1];
+    co->out = out[0];
+    co->pos = co->len = 0;
+    ends[0] = in[0];
+    ends[1] = out[1];
+    return co;
+}
+
+/*
+ * coproc_started - The coprocess runs as job: close the ends it has and
+ *    set NAME_PID.
+ */
+void coproc_started(struct coproc_t *co, struct job_t *job, int *ends)
+{
+    char var[64], pid[16];
+
+    close(ends[0]);
+    if (ends[1] >= 0)
+        close(ends[1]);
+    co->pid = job->pid;
+    sprintf(var, "%s_PID", co->name);
+    sprintf(pid, "%d", job->pid);
+    setvar(var, pid);
+}
+
+/* coproc_discard - Drop a coprocess that didn't start */
+void coproc_discard(struct coproc_t *co, int *ends)
+{
+    close(ends[0]);
+    if (ends[1] >= 0)
+        close(ends[1]);
+    coproc_close(co);
+}
+
+/*
+ * coproc_fd - tsh's end of the pipe from the coprocess called name (if
+ *    reading) or to it. Returns -1 (and says so) if there is none.
+ */
+int coproc_fd(const char *name, int reading)
+{
+    struct coproc_t *co = coproc_named(name);
+
+    if (co == NULL)
+        return -1;
+    return reading ? co->out : co->in;
+}
+
+/* coproc_wake - Event loop callback: the fd read waits for is ready */
+static void coproc_wake(int fd, uint32_t events)
+{
+    coproc_ready = 1;
+}
+
+/*
+ * coproc_wait - Wait in the event loop until fd is readable. Returns -1
+ *    if ctrl-c came first.
+ */
+static int coproc_wait(int fd)
+{
+    sigset_t mask, prev, waitmask;
+
+    if (watch_fd(fd, EPOLLIN, coproc_wake) < 0)
+        return 0; /* read() will wait instead */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    waitmask = prev;
+    sigdelset(&waitmask, SIGINT);
+    coproc_ready = 0;
+    coproc_cancel = 0;
+    coproc_waiting = 1;
+    while (!coproc_ready && !coproc_cancel)
+        wait_event(-1, &waitmask, 0);
+    coproc_waiting = 0;
+    unwatch_fd(fd);
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return coproc_cancel ? -1 : 0;
+}
+
+/*
+ * coproc_getline - Read a line of the coprocess's output into line,
+ *    without its newline. Returns its length, or -1 at end of file or
+ *    on ctrl-c.
+ */
+static int coproc_getline(struct coproc_t *co, char *line)
+{
+    char *nl;
+    int n, avail, eof = 0;
+
+    for (;;)
+    {
+        avail = co->len - co->pos;
+        nl = memchr(co->buf + co->pos, '\n', avail);
+        if (nl != NULL || avail == MAXLINE - 1 || (eof && avail > 0))
+        {
+            n = nl != NULL ? nl - (co->buf + co->pos) : avail;
+            memcpy(line, co->buf + co->pos, n);
+            line[n] = '\0';
+            co->pos += n + (nl != NULL);
+            return n;
+        }
+        if (eof)
+            return -1;
+        memmove(co->buf, co->buf + co->pos, avail);
+        co->len = avail;
+        co->pos = 0;
+        if (coproc_wait(co->out) < 0)
+            return -1;
+        if ((n = read(co->out, co->buf + co->len, MAXLINE - 1 - co->len)) > 0)
+            co->len += n;
+        else if (n == 0 || errno != EINTR)
+            eof = 1;
+    }
+}
+
+/*
+ * do_read - Execute the builtin read [NAME...]: read a line and give
+ *    each NAME a word of it, the last one the rest of the line, or
+ *    without NAME give REPLY the line. It comes from the coprocess co,
+ *    the file fd, or if both are absent tsh's own input. Returns the
+ *    exit status: 1 at end of file or on ctrl-c.
+ */
+static int do_read(char **argv, struct coproc_t *co, int fd)
+{
+    char line[MAXLINE];
+    char *p, *end;
+    int i, n = 0, got = 0;
+
+    for (i = 1; argv[i] != NULL; i++)
+        if (!isname(argv[i], strlen(argv[i])))
+        {
+            printf("read: %s: not a valid name\n", argv[i]);
+            return 2;
+        }
+
+    if (co != NULL)
+        n = coproc_getline(co, line);
+    else if (fd >= 0)
+    {
+        /* a byte at a time, to leave the rest for the next read */
+        while (n < MAXLINE - 1 && (got = read(fd, line + n, 1)) == 1 && line[n] != '\n')
+            n++;
+        if (n == 0 && got != 1)
+            n = -1; /* end of file before anything, not an empty line */
+        line[n > 0 ? n : 0] = '\0';
+    }
+    else if (read_line(line) != NULL)
+        line[n = strcspn(line, "\n")] = '\0';
+    else
+        n = -1;
+    if (n < 0)
+        return 1;
+
+    if (argv[1] == NULL)
+    {
+        setvar("REPLY", line);
+        return 0;
+    }
+    for (p = line, i = 1; argv[i] != NULL; i++)
+    {
+        p += strspn(p, " \t");
+        if (argv[i + 1] == NULL)
+        { /* the last NAME gets the rest, less trailing blanks */
+            for (end = p + strlen(p); end > p && (end[-1] == ' ' || end[-1] == '\t'); end--)
+                ;
+            *end = '\0';
+        }
+        else if (*(end = p + strcspn(p, " \t")) != '\0')
+            *end++ = '\0';
+        setvar(argv[i], p);
+        p = end;
+    }
+    return 0;
+}
+
+/* echo_text - Put what echo [-n] [word...] writes into buf; returns its length */
+static int echo_text(char **argv, char *buf)
+{
+    int i, first = 1, len = 0, newline = 1;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-n") == 0)
+    {
+        newline = 0;
+        first++;
+    }
+    for (i = first; argv[i] != NULL; i++)
+        len += sprintf(buf + len, "%s%s", i > first ? " " : "", argv[i]);
+    if (newline)
+        buf[len++] = '\n';
+    return len;
+}
+
+/* write_all - Write len bytes of buf to fd. Returns -1 on failure */
+static int write_all(int fd, const char *buf, int len)
+{
+    int n;
+
+    while (len > 0)
+    {
+        if ((n = write(fd, buf, len)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * io_builtin - Run echo or read in tsh, with their < file, <&NAME, >
+ *    and >> files and >&NAME. Returns the exit status, or -1 if argv
+ *    is neither.
+ */
+int io_builtin(char **argv, char *in, struct outs_t *outs, char *co_in)
+{
+    struct coproc_t *co = NULL;
+    char buf[MAXLINE + 1];
+    int k, len, fd = -1, status = 0;
+
+    if (strcmp(argv[0], "echo") == 0)
+    {
+        len = echo_text(argv, buf);
+        if (outs->n == 0)
+            fwrite(buf, 1, len, stdout);
+        for (k = 0; k < outs->n; k++)
+        {
+            if (outs->how[k] == OUT_COPROC)
+                fd = coproc_fd(outs->file[k], 0);
+            else if ((fd = open(outs->file[k], O_WRONLY | O_CREAT | O_CLOEXEC |
+                                (outs->how[k] == OUT_APPEND ? O_APPEND : O_TRUNC), 0666)) < 0)
+                printf("%s: %s\n", outs->file[k], strerror(errno));
+            if (fd < 0)
+            {
+                status = 1;
+                continue;
+            }
+            if (write_all(fd, buf, len) < 0)
+            {
+                printf("echo: write error: %s\n", strerror(errno));
+                status = 1;
+            }
+            if (outs->how[k] != OUT_COPROC)
+                close(fd);
+        }
+        return status;
+    }
+    if (strcmp(argv[0], "read") != 0)
+        return -1;
+
+    if (co_in != NULL && (co = coproc_named(co_in)) == NULL)
+        return 1;
+    if (in != NULL && (fd = open(in, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        printf("%s: %s\n", in, strerror(errno));
+        return 1;
+    }
+    status = do_read(argv, co, fd);
+    if (fd >= 0)
+        close(fd);
+    return status;
+}
+
+/*
+ * do_coproc - Execute the builtin coproc without a command: list the
+ *    coprocesses, or with -c NAME close tsh's ends of the pipes (the
+ *    coprocess reads end of file) and forget it. Returns the exit status.
+ */
+int do_coproc(char **argv)
+{
+    struct coproc_t *co;
+    struct job_t *job;
+    int i;
+
+    if (argv[1] == NULL)
+    {
+        for (i = 0; i < MAXCOPROCS; i++)
+        {
+            if (!coprocs[i].name[0] || coprocs[i].pid == 0)
+                continue;
+            if ((job = getjobpid(jobs, coprocs[i].pid)) != NULL)
+                printf("%s [%d] (%d) %s", coprocs[i].name, job->jid, job->pid, job->cmdline);
+            else
+                printf("%s (%d) Done\n", coprocs[i].name, coprocs[i].pid);
+        }
+        return 0;
+    }
+    if (strcmp(argv[1], "-c") == 0 && argv[2] != NULL && argv[3] == NULL)
+    {
+        if ((co = coproc_named(argv[2])) == NULL)
+            return 1;
+        coproc_close(co);
+        return 0;
+    }
+    printf("usage: coproc NAME command, coproc -c NAME\n");
+    return 2;
+}
+
+/*********************
+ * End coprocesses
+ *********************/
+
+/*************************************
+ * Line editor and command completion
+ *************************************/
+
+/* Names completed in command position besides the PATH executables */
+static const char *builtin_names[] = {"quit", "jobs", "bg", "fg", "true",
+                                      "false", "test", ":", "if", "for",
+                                      "while", "until", "break", "continue",
+                                      "return", "affinity", "nice", "limit",
+                                      "timeout", "kill", "joblog", "stats",
+                                      "dag", "coproc", "echo", "read", NULL};
+
+/* Words after which the next word is a command again */
+static const char *cmd_leaders[] = {"if", "elif", "then", "else", "while",
+                                    "until", "do", "{", NULL};
+
+static char outbuf[8 * MAXLINE];     /* terminal output of one repaint */
+static int outlen = 0;
+
+/* out_flush - Write the pending terminal output */
+static void out_flush(void)
+{
+    int off = 0, n;
+
+    while (off < outlen)
+    {
+        if ((n = write(STDOUT_FILENO, outbuf + off, outlen - off)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        off += n;
+    }
+    outlen = 0;
+}
+
+/* out_bytes - Queue n bytes of terminal output */
+static void out_bytes(const char *s, int n)
+{
+    if (outlen + n > (int)sizeof(outbuf))
+        out_flush();
+    if (n > (int)sizeof(outbuf))
+    {
+        write(STDOUT_FILENO, s, n);
+        return;
+    }
+    memcpy(outbuf + outlen, s, n);
+    outlen += n;
+}
+
+static void out_str(const char *s)
+{
+    out_bytes(s, strlen(s));
+}
+
+/* out_move - Move the cursor n columns right (n > 0) or left (n < 0) */
+static void out_move(int n)
+{
+    char seq[16];
+
+    if (n != 0)
+        out_bytes(seq, sprintf(seq, "\033[%d%c", n > 0 ? n : -n, n > 0 ? 'C' : 'D'));
+}
+
+/*
+ * render - Bring the terminal up to date with the edited line. Only the
+ *    part after the longest common prefix of the old and new line is
+ *    rewritten, so typing at the end of the line costs one byte.
+ */
+static void render(struct editor *ed)
+{
+    int p = 0;
+
+    while (p < ed->len && p < ed->shown_len && ed->buf[p] == ed->shown[p])
+        p++;
+    if (p < ed->len || p < ed->shown_len)
+    {
+        if (ed->shown_pos > p)
+            out_move(p - ed->shown_pos);
+        else
+            out_bytes(ed->shown + ed->shown_pos, p - ed->shown_pos);
+        out_bytes(ed->buf + p, ed->len - p);
+        if (ed->shown_len > ed->len)
+            out_str("\033[K");
+        ed->shown_pos = ed->len;
+    }
+    out_move(ed->pos - ed->shown_pos);
+    memcpy(ed->shown, ed->buf, ed->len);
+    ed->shown_len = ed->len;
+    ed->shown_pos = ed->pos;
+    out_flush();
+}
+
+/* repaint - Redraw the prompt and the whole line at the start of the row */
+static void repaint(struct editor *ed)
+{
+    out_str("\r");
+    out_str(ed->prompt);
+    out_str("\033[K");
+    ed->shown_len = ed->shown_pos = 0;
+    render(ed);
+}
+
+/* set_line - Replace the edited line by s, with the cursor at its end */
+static void set_line(struct editor *ed, const char *s)
+{
+    ed->len = strlen(s);
+    if (ed->len > MAXLINE - 2)
+        ed->len = MAXLINE - 2;
+    memcpy(ed->buf, s, ed->len);
+    ed->pos = ed->len;
+}
+
+/* replace_word - Replace buf[start..pos) by s */
+static void replace_word(struct editor *ed, int start, const char *s)
+{
+    int n = strlen(s);
+
+    if (ed->len - (ed->pos - start) + n > MAXLINE - 2)
+        return;
+    memmove(ed->buf + start + n, ed->buf + ed->pos, ed->len - ed->pos);
+    memcpy(ed->buf + start, s, n);
+    ed->len += n - (ed->pos - start);
+    ed->pos = start + n;
+}
+
+/* add_history - Remember a line for ctrl-p/ctrl-n and the arrow keys */
+static void add_history(const char *line, int len)
+{
+    if (len == 0 || (nhist > 0 && strlen(history[nhist - 1]) == (size_t)len &&
+                     strncmp(history[nhist - 1], line, len) == 0))
+        return;
+    if (nhist == MAXHIST)
+    {
+        free(history[0]);
+        memmove(history, history + 1, (MAXHIST - 1) * sizeof(char *));
+        nhist--;
+    }
+    history[nhist++] = strndup(line, len);
+}
+
+/* browse_history - Show the history entry dir steps older (-1) or newer */
+static void browse_history(struct editor *ed, int dir)
+{
+    int h = ed->hist + dir;
+
+    if (h < 0 || h > nhist)
+        return;
+    if (ed->hist == nhist)
+    {
+        memcpy(ed->saved, ed->buf, ed->len);
+        ed->saved[ed->len] = '\0';
+    }
+    ed->hist = h;
+    set_line(ed, h == nhist ? ed->saved : history[h]);
+}
+
+/* trie_node - Allocate a trie node for character c, return its index */
+static int trie_node(char c)
+{
+    if (nnodes == capnodes)
+    {
+        capnodes = capnodes ? 2 * capnodes : 4096;
+        if ((ctrie = realloc(ctrie, capnodes * sizeof(struct cnode))) == NULL)
+            unix_error("realloc error");
+    }
+    memset(&ctrie[nnodes], 0, sizeof(struct cnode));
+    ctrie[nnodes].c = c;
+    return nnodes++;
+}
+
+/* isword - Does a completion end at trie node n? */
+static int isword(int n)
+{
+    return ctrie[n].builtin || ctrie[n].dirs != 0;
+}
+
+/*
+ * trie_add - Record that name is in PATH directory dir, or is a builtin
+ *    (dir < 0). Children are kept in character order so that listings
+ *    come out sorted.
+ */
+static void trie_add(const char *name, int dir)
+{
+    int path[MAXLINE];
+    int depth = 0, n = 0, k, prev, m;
+    const unsigned char *p;
+
+    for (p = (const unsigned char *)name; *p && depth < MAXLINE; p++)
+    {
+        path[depth++] = n;
+        prev = 0;
+        for (k = ctrie[n].child; k && (unsigned char)ctrie[k].c < *p; k = ctrie[k].next)
+            prev = k;
+        if (!k || (unsigned char)ctrie[k].c != *p)
+        {
+            m = trie_node(*p);
+            ctrie[m].next = k;
+            if (prev)
+                ctrie[prev].next = m;
+            else
+                ctrie[n].child = m;
+            k = m;
+        }
+        n = k;
+    }
+
+    if (isword(n))
+    {
+        if (dir < 0)
+            ctrie[n].builtin = 1;
+        else
+            ctrie[n].dirs |= (uint64_t)1 << dir;
+        return;
+    }
+    if (dir < 0)
+        ctrie[n].builtin = 1;
+    else
+        ctrie[n].dirs |= (uint64_t)1 << dir;
+    ctrie[n].nwords++;
+    while (depth > 0)
+        ctrie[path[--depth]].nwords++;
+}
+
+/*
+ * trie_drop - Forget PATH directory dir below node n. Returns how many
+ *    names disappeared from the subtree. Emptied nodes stay in place and
+ *    are reused when the directory is scanned again.
+ */
+static int trie_drop(int n, int dir)
+{
+    int gone = 0, k;
+
+    for (k = ctrie[n].child; k; k = ctrie[k].next)
+        if (ctrie[k].nwords > 0)
+            gone += trie_drop(k, dir);
+    if (ctrie[n].dirs & ((uint64_t)1 << dir))
+    {
+        ctrie[n].dirs &= ~((uint64_t)1 << dir);
+        if (!isword(n))
+            gone++;
+    }
+    ctrie[n].nwords -= gone;
+    return gone;
+}
+
+/*
+ * scan_step - Add up to max more entries of the PATH directories being
+ *    scanned to the trie. Returns 1 if there is more to do (with max 0,
+ *    if a scan is in progress).
+ */
+static int scan_step(int max)
+{
+    struct dirent *de;
+    struct stat st;
+    DIR *d;
+    int i;
+
+    for (i = 0; i < npathdirs; i++)
+    {
+        if ((d = pathdirs[i].scan) == NULL)
+            continue;
+        for (; max > 0; max--)
+        {
+            if ((de = readdir(d)) == NULL)
+            {
+                closedir(d);
+                pathdirs[i].scan = NULL;
+                break;
+            }
+            if (de->d_name[0] == '.' || de->d_type == DT_DIR)
+                continue;
+            if (fstatat(dirfd(d), de->d_name, &st, 0) == 0 &&
+                S_ISREG(st.st_mode) && (st.st_mode & 0111))
+                trie_add(de->d_name, i);
+        }
+        if (max == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static struct wtimer scan_timer; /* runs the next slice of the scans */
+
+/* scan_due - Timer callback: scan for SCAN_MS, and come back while there is more */
+static void scan_due(struct wtimer *t)
+{
+    long long until = now_ns() + SCAN_MS * 1000000LL;
+    int more;
+
+    while ((more = scan_step(64)) && now_ns() < until)
+        ;
+    if (more)
+        timer_add(t, TICK_MS);
+}
+
+/*
+ * refresh_completions - Start over when PATH changed, and start a new
+ *    scan of every PATH directory whose modification time changed since
+ *    it was last scanned. The scans are done by scan_step(), a slice at
+ *    each tick of the timer wheel, so the shell stays responsive.
+ */
+static void refresh_completions(void)
+{
+    char *path = getenv("PATH");
+    char *p, *q;
+    struct stat st;
+    sigset_t mask, prev;
+    int i;
+
+    if (path == NULL)
+        path = "/bin:/usr/bin";
+    if (cached_path == NULL || strcmp(path, cached_path) != 0)
+    {
+        for (i = 0; i < npathdirs; i++)
+            if (pathdirs[i].scan != NULL)
+                closedir(pathdirs[i].scan);
+        free(cached_path);
+        cached_path = strdup(path);
+        nnodes = 0;
+        trie_node('\0');
+        for (i = 0; builtin_names[i] != NULL; i++)
+            trie_add(builtin_names[i], -1);
+        npathdirs = 0;
+        for (p = cached_path; *p && npathdirs < MAXPATHDIRS; p = *q ? q + 1 : q)
+        {
+            if ((q = strchr(p, ':')) == NULL)
+                q = p + strlen(p);
+            if (q > p && q - p < MAXLINE)
+            {
+                memset(&pathdirs[npathdirs], 0, sizeof(struct cdir));
+                memcpy(pathdirs[npathdirs].path, p, q - p);
+                npathdirs++;
+            }
+        }
+    }
+
+    for (i = 0; i < npathdirs; i++)
+    {
+        if (stat(pathdirs[i].path, &st) < 0)
+            memset(&st, 0, sizeof(st));
+        else if (pathdirs[i].scanned &&
+                 st.st_mtim.tv_sec == pathdirs[i].mtime.tv_sec &&
+                 st.st_mtim.tv_nsec == pathdirs[i].mtime.tv_nsec)
+            continue;
+        if (pathdirs[i].scan != NULL)
+            closedir(pathdirs[i].scan);
+        if (pathdirs[i].scanned)
+            trie_drop(0, i);
+        /* the time is taken before reading, so that a change during
+         * the scan is picked up by the next one */
+        pathdirs[i].mtime = st.st_mtim;
+        pathdirs[i].scan = opendir(pathdirs[i].path);
+        pathdirs[i].scanned = (pathdirs[i].scan != NULL);
+    }
+    if (scan_timer.pprev == NULL && scan_step(0))
+    {
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, &prev);
+        scan_timer.fn = scan_due;
+        timer_add(&scan_timer, TICK_MS);
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+    }
+}
+
+/* trie_list - Collect up to max names below node n, whose prefix is name */
+static void trie_list(int n, char *name, int len, char **out, int *cnt, int max)
+{
+    int k;
+
+    if (isword(n) && *cnt < max)
+    {
+        name[len] = '\0';
+        out[(*cnt)++] = strdup(name);
+    }
+    for (k = ctrie[n].child; k && *cnt < max && len < MAXLINE - 1; k = ctrie[k].next)
+    {
+        if (ctrie[k].nwords == 0)
+            continue;
+        name[len] = ctrie[k].c;
+        trie_list(k, name, len + 1, out, cnt, max);
+    }
+}
+
+/* show_matches - List completions below the line, then redraw it */
+static void show_matches(struct editor *ed, char **names, int n, int total)
+{
+    struct winsize ws;
+    int cols = 80, width = 0, col = 0, i;
+    char more[64];
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        cols = ws.ws_col;
+    for (i = 0; i < n; i++)
+        if ((int)strlen(names[i]) + 2 > width)
+            width = strlen(names[i]) + 2;
+
+    out_str("\r\n");
+    for (i = 0; i < n; i++)
+    {
+        if (col > 0 && col + width > cols)
+        {
+            out_str("\r\n");
+            col = 0;
+        }
+        out_str(names[i]);
+        if (i < n - 1)
+            for (col += strlen(names[i]); col % width; col++)
+                out_str(" ");
+        free(names[i]);
+    }
+    if (total > n)
+        out_bytes(more, sprintf(more, "\r\n... and %d more", total - n));
+    out_str("\r\n");
+    repaint(ed);
+}
+
+/*
+ * complete_command - Complete a command name from the builtins and PATH.
+ *    tsh runs commands by path, so a unique PATH executable is completed
+ *    to its full name in the first PATH directory that holds it. Names
+ *    still to be scanned aren't offered yet.
+ */
+static void complete_command(struct editor *ed, int start)
+{
+    char name[MAXLINE], text[2 * MAXLINE];
+    char *names[MAXLIST];
+    int len = ed->pos - start;
+    int n = 0, k, live, only, cnt = 0;
+
+    refresh_completions();
+    memcpy(name, ed->buf + start, len);
+    for (k = 0; k < len && n >= 0; k++)
+    {
+        for (n = ctrie[n].child; n && ctrie[n].c != name[k]; n = ctrie[n].next)
+            ;
+        if (n == 0)
+            n = -1;
+    }
+    if (n < 0 || ctrie[n].nwords == 0)
+        return;
+
+    /* follow the trie while there is only one way to go */
+    while (!isword(n) && len < MAXLINE - 1)
+    {
+        for (live = 0, only = 0, k = ctrie[n].child; k; k = ctrie[k].next)
+            if (ctrie[k].nwords > 0)
+            {
+                live++;
+                only = k;
+            }
+        if (live != 1)
+            break;
+        name[len++] = ctrie[only].c;
+        n = only;
+    }
+    name[len] = '\0';
+
+    if (ctrie[n].nwords == 1 && isword(n))
+    {
+        if (ctrie[n].builtin)
+            snprintf(text, sizeof(text), "%s ", name);
+        else
+            snprintf(text, sizeof(text), "%s/%s ",
+                     pathdirs[__builtin_ctzll(ctrie[n].dirs)].path, name);
+        replace_word(ed, start, text);
+    }
+    else if (len > ed->pos - start)
+        replace_word(ed, start, name);
+    else if (ed->tabs > 1)
+    {
+        trie_list(n, name, len, names, &cnt, MAXLIST);
+        show_matches(ed, names, cnt, ctrie[n].nwords);
+    }
+}
+
+/* cmpstr - qsort comparison of two strings */
+static int cmpstr(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* complete_file - Complete a file name relative to its directory part */
+static void complete_file(struct editor *ed, int start)
+{
+    char word[MAXLINE], dir[MAXLINE], common[MAXLINE], text[2 * MAXLINE];
+    char *names[MAXLIST];
+    char *base, *slash;
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+    int len = ed->pos - start;
+    int blen, clen = 0, total = 0, cnt = 0, isdir = 0, k;
+
+    memcpy(word, ed->buf + start, len);
+    word[len] = '\0';
+    if ((slash = strrchr(word, '/')) != NULL)
+    {
+        memcpy(dir, word, slash - word + 1);
+        dir[slash - word + 1] = '\0';
+        base = slash + 1;
+    }
+    else
+    {
+        strcpy(dir, "./");
+        base = word;
+    }
+    blen = strlen(base);
+    if ((d = opendir(dir)) == NULL)
+        return;
+
+    while ((de = readdir(d)) != NULL)
+    {
+        if (strncmp(de->d_name, base, blen) != 0 ||
+            (de->d_name[0] == '.' && base[0] != '.') ||
+            strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (total++ == 0)
+        {
+            clen = strlen(de->d_name);
+            memcpy(common, de->d_name, clen);
+            isdir = fstatat(dirfd(d), de->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        else
+        {
+            for (k = 0; k < clen && common[k] == de->d_name[k]; k++)
+                ;
+            clen = k;
+        }
+        if (cnt < MAXLIST)
+            names[cnt++] = strdup(de->d_name);
+    }
+    closedir(d);
+    common[clen] = '\0';
+
+    if (total == 1 || clen > blen)
+    {
+        snprintf(text, sizeof(text), "%.*s%s%s", (int)(base - word), word,
+                 common, total > 1 ? "" : isdir ? "/" : " ");
+        replace_word(ed, start, text);
+    }
+    else if (total > 1 && ed->tabs > 1)
+    {
+        qsort(names, cnt, sizeof(char *), cmpstr);
+        show_matches(ed, names, cnt, total);
+        return;
+    }
+    for (k = 0; k < cnt; k++)
+        free(names[k]);
+}
+
+/* complete - Complete the word before the cursor */
+static void complete(struct editor *ed)
+{
+    char w[MAXLINE];
+    int start, i, j;
+
+    for (start = ed->pos; start > 0 && ed->buf[start - 1] != ' '; start--)
+        ;
+    if (memchr(ed->buf + start, '/', ed->pos - start) != NULL)
+    {
+        complete_file(ed, start);
+        return;
+    }
+
+    /* a command follows the start of the line, | ; & and keywords */
+    for (i = start; i > 0 && ed->buf[i - 1] == ' '; i--)
+        ;
+    for (j = i; j > 0 && ed->buf[j - 1] != ' '; j--)
+        ;
+    memcpy(w, ed->buf + j, i - j);
+    w[i - j] = '\0';
+    if (i == 0 || strchr("|;&", ed->buf[i - 1]) != NULL || iskeyword(w, cmd_leaders))
+    {
+        if (ed->pos > start)
+            complete_command(ed, start);
+    }
+    else
+        complete_file(ed, start);
+}
+
+/*
+ * edit_key - Handle one input byte. Returns 1 when the line is done,
+ *    -1 at end of file, 0 otherwise.
+ */
+static int edit_key(struct editor *ed, unsigned char c)
+{
+    if (ed->esc == 1)
+    {
+        ed->esc = (c == '[' || c == 'O') ? 2 : 0;
+        ed->arg = 0;
+        return 0;
+    }
+    if (ed->esc == 2)
+    {
+        if (isdigit(c))
+        {
+            ed->arg = 10 * ed->arg + c - '0';
+            return 0;
+        }
+        ed->esc = 0;
+        if (c == 'A')
+            browse_history(ed, -1);
+        else if (c == 'B')
+            browse_history(ed, 1);
+        else if (c == 'C' && ed->pos < ed->len)
+            ed->pos++;
+        else if (c == 'D' && ed->pos > 0)
+            ed->pos--;
+        else if (c == 'H' || (c == '~' && (ed->arg == 1 || ed->arg == 7)))
+            ed->pos = 0;
+        else if (c == 'F' || (c == '~' && (ed->arg == 4 || ed->arg == 8)))
+            ed->pos = ed->len;
+        else if (c == '~' && ed->arg == 3 && ed->pos < ed->len)
+        {
+            memmove(ed->buf + ed->pos, ed->buf + ed->pos + 1, ed->len - ed->pos - 1);
+            ed->len--;
+        }
+        return 0;
+    }
+
+    ed->tabs = (c == '\t') ? ed->tabs + 1 : 0;
+    switch (c)
+    {
+    case '\r':
+    case '\n':
+        return 1;
+    case 4: /* ctrl-d */
+        if (ed->len == 0)
+            return -1;
+        if (ed->pos < ed->len)
+        {
+            memmove(ed->buf + ed->pos, ed->buf + ed->pos + 1, ed->len - ed->pos - 1);
+            ed->len--;
+        }
+        break;
+    case 3: /* ctrl-c abandons the line */
+        ed->len = ed->pos = 0;
+        ed->hist = nhist;
+        out_str("^C\r\n");
+        out_str(ed->prompt);
+        ed->shown_len = ed->shown_pos = 0;
+        break;
+    case 8:
+    case 127:
+        if (ed->pos > 0)
+        {
+            memmove(ed->buf + ed->pos - 1, ed->buf + ed->pos, ed->len - ed->pos);
+            ed->pos--;
+            ed->len--;
+        }
+        break;
+    case '\t':
+        complete(ed);
+        break;
+    case 1: /* ctrl-a */
+        ed->pos = 0;
+        break;
+    case 5: /* ctrl-e */
+        ed->pos = ed->len;
+        break;
+    case 2: /* ctrl-b */
+        if (ed->pos > 0)
+            ed->pos--;
+        break;
+    case 6: /* ctrl-f */
+        if (ed->pos < ed->len)
+            ed->pos++;
+        break;
+    case 11: /* ctrl-k */
+        ed->len = ed->pos;
+        break;
+    case 21: /* ctrl-u */
+        memmove(ed->buf, ed->buf + ed->pos, ed->len - ed->pos);
+        ed->len -= ed->pos;
+        ed->pos = 0;
+        break;
+    case 23: /* ctrl-w */
+    {
+        int start = ed->pos;
+
+        while (start > 0 && ed->buf[start - 1] == ' ')
+            start--;
+        while (start > 0 && ed->buf[start - 1] != ' ')
+            start--;
+        replace_word(ed, start, "");
+        break;
+    }
+    case 12: /* ctrl-l */
+        out_str("\033[H\033[2J");
+        repaint(ed);
+        break;
+    case 16: /* ctrl-p */
+        browse_history(ed, -1);
+        break;
+    case 14: /* ctrl-n */
+        browse_history(ed, 1);
+        break;
+    case 27:
+        ed->esc = 1;
+        break;
+    default:
+        if (c >= ' ' && ed->len < MAXLINE - 2)
+        {
+            memmove(ed->buf + ed->pos + 1, ed->buf + ed->pos, ed->len - ed->pos);
+            ed->buf[ed->pos++] = c;
+            ed->len++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * init_editor - Edit command lines when tsh owns a terminal that
+ *    understands cursor movement and prompts are on (-p turns the
+ *    editor off for the test drivers).
+ */
+void init_editor(void)
+{
+    char *term = getenv("TERM");
+
+    editing = emit_prompt && interactive && isatty(STDOUT_FILENO) &&
+              term != NULL && *term != '\0' && strcmp(term, "dumb") != 0;
+}
+
+/*
+ * edit_line - Read a line with the line editor, in raw mode. The line
+ *    is stored in buf with a trailing newline, like fgets(). Returns
+ *    NULL at end of file. Keys typed past the end of the line are kept
+ *    for the next call.
+ */
+char *edit_line(char *buf, char *prompt_str)
+{
+    struct editor ed;
+    struct termios raw;
+    int n, done = 0;
+
+    fflush(stdout);
+    raw = shell_tmodes;
+    raw.c_iflag &= ~(ICRNL | INLCR | IGNCR | IXON | ISTRIP | BRKINT | INPCK);
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    memset(&ed, 0, sizeof(ed));
+    ed.prompt = prompt_str;
+    ed.hist = nhist;
+    out_str(prompt_str);
+    out_flush();
+    refresh_completions();
+
+    while (!done)
+    {
+        if (inpos == inlen)
+        {
+            line_shown = 1;
+            n = wait_event(-1, NULL, 1);
+            line_shown = 0;
+            if (async_output)
+            {
+                async_output = 0;
+                repaint(&ed);
+            }
+            if (n == 0)
+                continue;
+            /* a job report may have been printed over the line */
+            if (n < 0)
+            {
+                repaint(&ed);
+                continue;
+            }
+            if ((n = read(STDIN_FILENO, inbuf, sizeof(inbuf))) < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                done = -1;
+                break;
+            }
+            inlen = n;
+            inpos = 0;
+        }
+        while (inpos < inlen && !done)
+            done = edit_key(&ed, inbuf[inpos++]);
+        if (done >= 0)
+            render(&ed);
+    }
+
+    if (done > 0)
+    {
+        ed.pos = ed.len;
+        render(&ed);
+        add_history(ed.buf, ed.len);
+        memcpy(buf, ed.buf, ed.len);
+        buf[ed.len] = '\n';
+        buf[ed.len + 1] = '\0';
+    }
+    out_str("\r\n");
+    out_flush();
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    return done > 0 ? buf : NULL;
+}
+
+/****************
+ * End line editor
+ ****************/
+
+/*****************************************
+ * Control socket: tsh -S path as a daemon
+ *****************************************/
+
+/*
+ * Clients send one request per line and get back any output followed by
+ * a last line of OK or ERR <reason>:
+ *
+ *     CMD ...          submit CMD as a background job ("[1] (pid) CMD")
+ *     run CMD ...      submit CMD and wait for it, as wait does
+ *     wait %jid|pid    wait for a job; EXIT <status> once it ends
+ *     fg %jid|pid      wait, continuing the job first if it is stopped
+ *     jobs, bg, kill   the builtins, answered right away
+ *     quit             close the connection
+ *     shutdown         stop serving; running jobs are left alone
+ *
+ * Jobs read /dev/null and write to tsh's stdout, which is also the log.
+ * Compound commands are refused: their foreground jobs would hold up
+ * every other client.
+ */
+
+struct client_t
+{                          /* A connection to the control socket */
+    int fd;
+    char in[MAXLINE + 1];  /* request bytes not handled yet */
+    int inlen;
+    int skip;              /* if true, drop input up to the next newline */
+    char *out;             /* response bytes not sent yet */
+    int outlen;
+    int outcap;
+    pid_t wait_pid;        /* job the client waits for, 0 if none */
+    int resumed;           /* if true, its wait just ended */
+    int eof;               /* if true, no more requests will be read */
+    int closing;           /* if true, it said quit; answer nothing more */
+};
+
+struct done_t
+{                /* A job that ended, for waits that come too late */
+    pid_t pid;
+    int jid;
+    int status;  /* as $? would have it */
+};
+
+static struct client_t *clients[MAXFDS]; /* by fd */
+static struct done_t done[MAXDONE];      /* ring of the last jobs to end */
+static int ndone = 0;                    /* jobs that ever ended */
+static int cap_fd = -1;                  /* collects a request's output */
+static int daemon_done = 0;              /* set by shutdown, SIGINT, SIGTERM */
+static int nresumed = 0;                 /* clients whose wait just ended */
+
+static void client_ready(int fd, uint32_t events);
+
+/* client_close - Hang up on a client */
+static void client_close(struct client_t *c)
+{
+    unwatch_fd(c->fd);
+    close(c->fd);
+    clients[c->fd] = NULL;
+    free(c->out);
+    free(c);
+}
+
+/* client_send - Queue len bytes of response for a client */
+static void client_send(struct client_t *c, const char *buf, int len)
+{
+    if (c->outlen + len > c->outcap)
+    {
+        c->outcap = 2 * (c->outlen + len);
+        if ((c->out = realloc(c->out, c->outcap)) == NULL)
+            unix_error("realloc error");
+    }
+    memcpy(c->out + c->outlen, buf, len);
+    c->outlen += len;
+}
+
+static void client_reply(struct client_t *c, const char *text)
+{
+    client_send(c, text, strlen(text));
+}
+
+/*
+ * client_flush - Send what the socket takes now and watch for room for
+ *    the rest. A client that is done is closed once it has everything.
+ *    Returns -1 if the client was closed.
+ */
+static int client_flush(struct client_t *c)
+{
+    int n;
+
+    while (c->outlen > 0)
+    {
+        if ((n = send(c->fd, c->out, c->outlen, MSG_NOSIGNAL)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            client_close(c);
+            return -1;
+        }
+        memmove(c->out, c->out + n, c->outlen - n);
+        c->outlen -= n;
+    }
+    if (c->eof && c->outlen == 0 && c->wait_pid == 0)
+    {
+        client_close(c);
+        return -1;
+    }
+    watch_fd(c->fd, (c->eof ? 0 : EPOLLIN) | (c->outlen > 0 ? EPOLLOUT : 0),
+             client_ready);
+    return 0;
+}
+
+/* capture_begin - Collect what tsh prints from here on for a response */
+static void capture_begin(void)
+{
+    fflush(stdout);
+    dup2(cap_fd, STDOUT_FILENO);
+    dup2(cap_fd, STDERR_FILENO);
+}
+
+/* capture_end - Queue the collected output for c and go back to the log */
+static void capture_end(struct client_t *c)
+{
+    char buf[4096];
+    off_t off = 0;
+    ssize_t n;
+
+    fflush(stdout);
+    dup2(log_fd, STDOUT_FILENO);
+    dup2(log_fd, STDERR_FILENO);
+    while ((n = pread(cap_fd, buf, sizeof(buf), off)) > 0)
+    {
+        client_send(c, buf, n);
+        off += n;
+    }
+    ftruncate(cap_fd, 0);
+    lseek(cap_fd, 0, SEEK_SET);
+}
+
+/* reply_status - End a response with OK, or ERR and the exit status */
+static void reply_status(struct client_t *c, int status)
+{
+    if (status == 0)
+        client_reply(c, "OK\n");
+    else
+    {
+        sprintf(sbuf, "ERR exit %d\n", status);
+        client_reply(c, sbuf);
+    }
+}
+
+/*
+ * report_exit - The reap hook: remember how a job ended and answer the
+ *    clients waiting for it.
+ */
+static void report_exit(struct job_t *job, int status)
+{
+    struct done_t *d = &done[ndone++ % MAXDONE];
+    int fd;
+
+    d->pid = job->pid;
+    d->jid = job->jid;
+    if (job->timed_out)
+        d->status = 124;
+    else if (WIFSIGNALED(status))
+        d->status = 128 + WTERMSIG(status);
+    else
+        d->status = WEXITSTATUS(status);
+
+    for (fd = 0; fd < MAXFDS; fd++)
+    {
+        if (clients[fd] != NULL && clients[fd]->wait_pid == job->pid)
+        {
+            sprintf(sbuf, "EXIT %d\nOK\n", d->status);
+            client_reply(clients[fd], sbuf);
+            clients[fd]->wait_pid = 0;
+            clients[fd]->resumed = 1;
+            nresumed++;
+        }
+    }
+}
+
+/*
+ * wait_job - Make c wait for the job named by target (%jid or pid),
+ *    continuing it first if cont. A job that has already ended is
+ *    answered from the ring of finished jobs.
+ */
+static void wait_job(struct client_t *c, const char *target, int cont)
+{
+    struct job_t *job;
+    int jid = 0, i;
+    pid_t pid = 0;
+
+    if (target[0] == '%')
+        job = getjobjid(jobs, (jid = atoi(target + 1)));
+    else
+        job = getjobpid(jobs, (pid = atoi(target)));
+    if (jid <= 0 && pid <= 0)
+    {
+        client_reply(c, "ERR argument must be a PID or %job id\n");
+        return;
+    }
+    if (job != NULL)
+    {
+        if (cont && job->state == ST)
+        {
+            kill(-job->pgid, SIGCONT);
+            job->state = BG;
+        }
+        c->wait_pid = job->pid;
+        return;
+    }
+
+    for (i = 1; i <= MAXDONE && i <= ndone; i++)
+    {
+        struct done_t *d = &done[(ndone - i) % MAXDONE];
+        if ((jid > 0 && d->jid == jid) || (pid > 0 && d->pid == pid))
+        {
+            sprintf(sbuf, "EXIT %d\nOK\n", d->status);
+            client_reply(c, sbuf);
+            return;
+        }
+    }
+    sprintf(sbuf, "ERR %.64s: No such job\n", target);
+    client_reply(c, sbuf);
+}
+
+/*
+ * submit - Run the statements of a request with their output going to
+ *    c: builtins and assignments in place, everything else as a
+ *    background job. Sets *pid to the last job started (0 if none) and
+ *    returns the exit status, or -1 if the request was refused.
+ */
+static int submit(struct client_t *c, char *request, pid_t *pid)
+{
+    static const char *inplace[] = {"jobs", "bg", "kill", "joblog", "stats",
+                                    "true", "false", "test", "[", ":", "echo", NULL};
+    static const char *refused[] = {"then", "else", "elif", "do", "fg",
+                                    "quit", "break", "continue", "return",
+                                    "dag", "coproc", "read", NULL};
+    struct stmts_t st = {NULL, 0, 0};
+    char stmt[MAXLINE + 2];
+    char w[MAXLINE];
+    char name[MAXLINE];
+    pid_t prev_bg = last_bg_pid;
+    char *eq;
+    int i, len;
+
+    split_stmts(request, &st);
+    for (i = 0; i < st.n; i++)
+    {
+        firstword(st.s[i], w, MAXLINE);
+        if (stmt_depth(st.s[i]) != 0 || iskeyword(w, refused) ||
+            funcname(st.s[i], name))
+        {
+            sprintf(sbuf, "ERR %.64s can't be submitted\n", w);
+            client_reply(c, sbuf);
+            free_stmts(&st);
+            return -1;
+        }
+    }
+
+    *pid = 0;
+    last_status = 0;
+    capture_begin();
+    for (i = 0; i < st.n; i++)
+    {
+        firstword(st.s[i], w, MAXLINE);
+        eq = strchr(w, '=');
+        len = strlen(st.s[i]);
+        if (iskeyword(w, inplace) || (eq != NULL && isname(w, eq - w)) ||
+            st.s[i][len - 1] == '&')
+            strcpy(stmt, st.s[i]);
+        else if (!job_slot_free())
+        {
+            printf("job table full\n");
+            last_status = 1;
+            break;
+        }
+        else
+            sprintf(stmt, "%s &", st.s[i]);
+
+        last_bg_pid = 0;
+        exec_simple(stmt);
+        if (last_bg_pid != 0)
+            *pid = prev_bg = last_bg_pid;
+    }
+    last_bg_pid = prev_bg;
+    capture_end(c);
+    free_stmts(&st);
+    return last_status;
+}
+
+/* serve_request - Answer one request line of a client */
+static void serve_request(struct client_t *c, char *line)
+{
+    char w[MAXLINE];
+    char *rest;
+    pid_t pid;
+    int status;
+
+    firstword(line, w, MAXLINE);
+    rest = strstr(line, w) + strlen(w);
+    rest += strspn(rest, " \t");
+
+    if (w[0] == '\0')
+        client_reply(c, "OK\n");
+    else if (strcmp(w, "quit") == 0 || strcmp(w, "exit") == 0)
+    {
+        client_reply(c, "OK\n");
+        c->eof = c->closing = 1;
+    }
+    else if (strcmp(w, "shutdown") == 0)
+    {
+        client_reply(c, "OK\n");
+        daemon_done = 1;
+    }
+    else if (strcmp(w, "wait") == 0 || strcmp(w, "fg") == 0)
+    {
+        if (*rest == '\0')
+        {
+            sprintf(sbuf, "ERR %.4s command requires PID or %%job id argument\n", w);
+            client_reply(c, sbuf);
+        }
+        else
+            wait_job(c, rest, w[0] == 'f');
+    }
+    else if (strcmp(w, "run") == 0)
+    {
+        if ((status = submit(c, rest, &pid)) > 0)
+            reply_status(c, status);
+        else if (status == 0 && pid == 0)
+            client_reply(c, "OK\n");
+        else if (status == 0)
+            c->wait_pid = pid;
+    }
+    else if ((status = submit(c, line, &pid)) >= 0)
+        reply_status(c, status);
+}
+
+/*
+ * client_serve - Answer the complete requests a client has sent, up to
+ *    the first it has to wait for, then send what can be sent.
+ */
+static void client_serve(struct client_t *c)
+{
+    char *nl;
+    int len;
+
+    while (!c->closing && c->wait_pid == 0 && c->inlen > 0)
+    {
+        c->in[c->inlen] = '\0';
+        if ((nl = memchr(c->in, '\n', c->inlen)) != NULL)
+            len = nl - c->in + 1;
+        else if (c->inlen == MAXLINE)
+        {
+            /* too long; refuse it once and drop the rest of the line */
+            if (!c->skip)
+                client_reply(c, "ERR line too long\n");
+            c->skip = 1;
+            c->inlen = 0;
+            break;
+        }
+        else if (c->eof)
+            len = c->inlen; /* a last request without a newline */
+        else
+            break;
+
+        c->in[len - (nl != NULL)] = '\0';
+        if (len > 1 && nl != NULL && nl[-1] == '\r')
+            nl[-1] = '\0';
+        if (c->skip)
+            c->skip = 0;
+        else
+            serve_request(c, c->in);
+        memmove(c->in, c->in + len, c->inlen - len);
+        c->inlen -= len;
+    }
+    fflush(stdout);
+    client_flush(c);
+}
+
+/* client_ready - Read the requests a client has sent, or send it more */
+static void client_ready(int fd, uint32_t events)
+{
+    struct client_t *c = clients[fd];
+    int n;
+
+    if (events & EPOLLERR)
+    {
+        client_close(c);
+        return;
+    }
+    while (!c->eof && c->inlen < MAXLINE)
+    {
+        if ((n = read(fd, c->in + c->inlen, MAXLINE - c->inlen)) > 0)
+            c->inlen += n;
+        else if (n == 0 || errno != EINTR)
+        {
+            if (n == 0 || errno != EAGAIN)
+                c->eof = 1;
+            break;
+        }
+    }
+    /* one that hung up altogether can't hear the answer it waits for */
+    if ((events & EPOLLHUP) && c->wait_pid != 0)
+    {
+        client_close(c);
+        return;
+    }
+    client_serve(c);
+}
+
+/* accept_clients - Take every pending connection to the control socket */
+static void accept_clients(int fd, uint32_t events)
+{
+    struct client_t *c;
+    int cfd;
+
+    while ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        if (cfd >= MAXFDS || (c = calloc(1, sizeof(*c))) == NULL)
+        {
+            close(cfd);
+            continue;
+        }
+        c->fd = cfd;
+        clients[cfd] = c;
+        if (watch_fd(cfd, EPOLLIN, client_ready) < 0)
+            client_close(c);
+    }
+}
+
+/*
+ * signal_ready - Take the signals the daemon keeps blocked: reap on
+ *    SIGCHLD and let the clients whose job ended go on; stop on SIGINT
+ *    and SIGTERM.
+ */
+static void signal_ready(int fd, uint32_t events)
+{
+    struct signalfd_siginfo si;
+    int reap = 0;
+
+    while (read(fd, &si, sizeof(si)) == sizeof(si))
+    {
+        if (si.ssi_signo == SIGCHLD)
+            reap = 1;
+        else if (si.ssi_signo == SIGINT || si.ssi_signo == SIGTERM)
+            daemon_done = 1;
+    }
+    if (!reap)
+        return;
+
+    sigchld_handler(SIGCHLD);
+    for (fd = 0; nresumed > 0 && fd < MAXFDS; fd++)
+    {
+        if (clients[fd] != NULL && clients[fd]->resumed)
+        {
+            clients[fd]->resumed = 0;
+            client_serve(clients[fd]);
+        }
+    }
+    nresumed = 0;
+}
+
+/*
+ * run_daemon - Serve the control socket at path until shutdown, SIGINT or
+ *    SIGTERM. Refuses to take over a socket another tsh still answers on;
+ *    one nobody answers on is left over from a crash and is replaced.
+ */
+void run_daemon(const char *path)
+{
+    struct sockaddr_un addr;
+    sigset_t mask;
+    mode_t old_umask;
+    int listen_fd, sig_fd, probe, fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        app_error("socket path too long");
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        unix_error("socket error");
+    if (connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        printf("%s: another tsh is serving this socket\n", path);
+        exit(1);
+    }
+    close(probe);
+    unlink(path);
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        unix_error("socket error");
+    old_umask = umask(077);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        unix_error("bind error");
+    umask(old_umask);
+    if (listen(listen_fd, SOMAXCONN) < 0)
+        unix_error("listen error");
+
+    /* signals arrive as events; jobs still start with job_mask */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sigdelset(&mask, SIGPIPE);
+    if ((sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        unix_error("signalfd error");
+
+    if ((log_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3)) < 0 ||
+        (null_fd = open("/dev/null", O_RDWR | O_CLOEXEC)) < 0 ||
+        (cap_fd = memfd_create("tsh-capture", MFD_CLOEXEC)) < 0)
+        unix_error("daemon setup error");
+    if (watch_fd(listen_fd, EPOLLIN, accept_clients) < 0 ||
+        watch_fd(sig_fd, EPOLLIN, signal_ready) < 0)
+        unix_error("epoll_ctl error");
+    daemon_mode = 1;
+    emit_prompt = 0;
+    reap_hook = report_exit;
+
+    printf("tsh: serving %s\n", path);
+    fflush(stdout);
+    while (!daemon_done)
+    {
+        pool_refill();
+        stats_flush();
+        wait_event(-1, NULL, 0);
+        fflush(stdout);
+    }
+
+    for (fd = 0; fd < MAXFDS; fd++)
+        if (clients[fd] != NULL)
+        {
+            clients[fd]->eof = 1;
+            clients[fd]->wait_pid = 0;
+            if (client_flush(clients[fd]) == 0)
+                client_close(clients[fd]);
+        }
+    unlink(path);
+    printf("tsh: stopped serving %s\n", path);
+    exit(0);
+}
+
+/*************************
+ * End control socket
+ *************************/
+
+/*****************
+ * Signal handlers
+ *****************/
+
+/* 
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminates (becomes a zombie), or stops because it
+ *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
+ *     available zombie children, but doesn't wait for any other
+ *     currently running children to terminate.  
+ */
+void sigchld_handler(int sig)
+{
+    sigset_t mask_all, prev_all;
+
+    int child_pid;
+    int status;
+    long long chld_ns = now_ns();
+    int nreaped = 0;
+
+    sigfillset(&mask_all);
+    while ((child_pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0)
+    {
+        if (child_pid == -1) {
+            perror("waitpid");
+            exit(EXIT_FAILURE);
+        }
+
+        sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+        if (!WIFSTOPPED(status) && !WIFCONTINUED(status)) {
+            stats_reaped(child_pid, chld_ns);
+            nreaped++;
+        }
+
+        int jid = pid2jid(child_pid);
+        // earlier stages of a pipeline are not jobs; just reap them
+        if (child_pid > 0 && jid == 0) {
+            sigprocmask(SIG_SETMASK, &prev_all, NULL);
+        }
+        else if (child_pid > 0) {
+
+            // remember how the foreground job ended for if/while
+            struct job_t* job = getjobpid(jobs, child_pid);
+            if (job != NULL && job->state == FG) {
+                if (WIFEXITED(status)) last_status = WEXITSTATUS(status);
+                else if (WIFSIGNALED(status)) last_status = 128 + WTERMSIG(status);
+                else if (WIFSTOPPED(status)) last_status = 128 + WSTOPSIG(status);
+            }
+
+            if (job != NULL && job->timed_out && !WIFSTOPPED(status) && !WIFCONTINUED(status)) {
+                printf("Job [%d] (%d) timed out\n", jid, child_pid);
+                fflush(stdout);
+                if (job->state == FG) last_status = 124;
+            }
+            else if (WIFEXITED(status)) {
+                // printf("Job [%d] (%d) terminated by signal %d\n",jid,child_pid,sig);
+                // fflush(stdout);
+            }
+            else if (WIFSIGNALED(status)) {
+                printf("Job [%d] (%d) terminated by signal %d\n",jid,child_pid,WTERMSIG(status));
+                fflush(stdout);
+            }
+            else if (WIFSTOPPED(status)) {
+                printf("Job [%d] (%d) stopped by signal %d\n",jid,child_pid, WSTOPSIG(status));
+                fflush(stdout);
+                
+                updateJobState(jobs, child_pid, ST);
+                stats.stopped++;
+            }
+            else if (WIFCONTINUED(status)) {
+            }
+
+
+            if (!WIFSTOPPED(status) && !WIFCONTINUED(status)) {
+                if (job != NULL) stats_ended(job, status);
+                if (reap_hook != NULL && job != NULL) reap_hook(job, status);
+                deletejob(jobs, child_pid);
+            }
+
+            sigprocmask(SIG_SETMASK, &prev_all, NULL);
+
+        }
+    }
+    stats.sigchlds++;
+    if (nreaped > 0)
+        hist_add(&stats.batch, nreaped);
+    return;
+}
+
+/* 
+ * sigint_handler - The kernel sends a SIGINT to the shell whenver the
+ *    user types ctrl-c at the keyboard.  Catch it and send it along
+ *    to the foreground job.  
+ */
+void sigint_handler(int sig)
+{
+    int fgPid = fgpid(jobs);
+    if ( fgPid > 0) {
+        kill(-getjobpid(jobs, fgPid)->pgid,SIGINT);
+    }
+    else if (dag_active) {
+        dag_cancel = 1;
+    }
+    else if (coproc_waiting) {
+        coproc_cancel = 1;
     }
     printf("\n");
     fflush(stdout);
@@ -588,7 +6836,7 @@ void sigtstp_handler(int sig)
 {
     int fgPid = fgpid(jobs);
     if ( fgPid > 0) {
-        kill(-fgPid,SIGTSTP);
+        kill(-getjobpid(jobs, fgPid)->pgid,SIGTSTP);
     }
     printf("\n");
     fflush(stdout);
@@ -610,6 +6858,10 @@ void clearjob(struct job_t *job)
     job->jid = 0;
     job->state = UNDEF;
     job->cmdline[0] = '\0';
+    job->has_tmodes = 0;
+    memset(&job->opts, 0, sizeof(job->opts));
+    timer_cancel(&job->timer);
+    job->timed_out = 0;
 }
 
 /* initjobs - Initialize the job list */
@@ -621,6 +6873,17 @@ void initjobs(struct job_t *jobs)
         clearjob(&jobs[i]);
 }
 
+/* job_slot_free - Is there room in the job list for one more job? */
+int job_slot_free(void)
+{
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+        if (jobs[i].pid == 0)
+            return 1;
+    return 0;
+}
+
 /* maxjid - Returns largest allocated job ID */
 int maxjid(struct job_t *jobs)
 {
@@ -647,6 +6910,10 @@ int addjob(struct job_t *jobs, pid_t pid, pid_t pgid, int state, char *cmdline)
             jobs[i].pid = pid;
             jobs[i].pgid = pgid;
             jobs[i].state = state;
+            // after a wrap, skip the IDs of jobs still running
+            while (getjobjid(jobs, nextjid) != NULL)
+                if (++nextjid > MAXJOBS)
+                    nextjid = 1;
             jobs[i].jid = nextjid++;
             if (nextjid > MAXJOBS)
                 nextjid = 1;
@@ -676,6 +6943,8 @@ int deletejob(struct job_t *jobs, pid_t pid)
         {
             clearjob(&jobs[i]);
             nextjid = maxjid(jobs) + 1;
+            if (nextjid > MAXJOBS)
+                nextjid = 1;
             return 1;
         }
     }
@@ -734,9 +7003,10 @@ int pid2jid(pid_t pid)
     return 0;
 }
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jobs)
+/* listjobs - Print the job list, with the placement of each job if details */
+void listjobs(struct job_t *jobs, int details)
 {
+    char opts[MAXLINE];
     int i;
 
     for (i = 0; i < MAXJOBS; i++)
@@ -760,6 +7030,11 @@ void listjobs(struct job_t *jobs)
                        i, jobs[i].state);
             }
             printf("%s", jobs[i].cmdline);
+            if (details)
+            {
+                format_jobopts(&jobs[i].opts, opts);
+                printf("    pgid=%d%s\n", jobs[i].pgid, opts);
+            }
         }
     }
 }
@@ -782,10 +7057,11 @@ void updateJobState(struct job_t *jobs, pid_t pid, int state) {
  */
 void usage(void)
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvp] [-S path]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -S   serve jobs submitted on the Unix socket <path>\n");
     exit(1);
 }
 
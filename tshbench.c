@@ -0,0 +1,937 @@
+/*
+ * tshbench.c - Stress and latency benchmark driver for the tiny shell
+ *
+ * usage: tshbench [-hv] [-s <shell>] [-a <args>] [-j <n>] [-n <runs>]
+ *                 [-c <n>] [-e <n>] [-l <n>] [-o <n>] [-q <n>]
+ *                 [-b <baseline>] [-w <baseline>] [-r <pct>] [<trace>...]
+ *
+ * Replays trace files (the same format sdriver.pl reads) against the
+ * shell, which runs on a pseudo-terminal so that it prints its prompt.
+ * Up to <n> traces run at once. For every shell command the driver
+ * measures the turnaround from writing the line to the next prompt, and
+ * for every TSTP/INT the delay until the shell reports the job "stopped"
+ * or "terminated by signal". The report gives p50/p99 of both and the
+ * system-wide fork rate while the traces ran.
+ *
+ * With -c, one more shell runs a foreground ./myspin <n> times and the
+ * driver types ctrl-c on the terminal, timing each keypress until the
+ * next prompt (the keystroke-to-exit latency a user sees).
+ *
+ * With -e, a shell with the line editor on (TERM=xterm) and a PATH of
+ * 50000 executables gets <n> keystrokes, each timed until it is echoed,
+ * and every tenth key is a Tab completing a full command name, timed
+ * until the completed word is shown.
+ *
+ * With -l, a shell runs /bin/echo <n> times with LAUNCHERS=0 (a fork per
+ * command) and <n> times with LAUNCHERS=4 (pre-forked launchers), each
+ * timed from writing the line until the echo's output arrives.
+ *
+ * With -o, a shell copies 16M from ./myflood into two files and wc -c
+ * <n> times through /bin/tee (./myflood | /bin/tee a b | wc -c) and <n>
+ * times with its own fan-out (./myflood > a > b | wc -c), each timed
+ * until wc's count and the prompt are out and both files are complete.
+ *
+ * With -q, a shell sends <n> queries to ./myserver started once as a
+ * coprocess (echo q >&Q; read r <&Q; echo $r) and runs ./myserver q
+ * <n> times, a process per query, each timed until the answer and the
+ * prompt are out.
+ *
+ * With -w the results are stored as a baseline; with -b they are compared
+ * against one and the exit status is 1 if a latency percentile is more
+ * than <pct> percent (default 25) above it, or if there is no baseline.
+ *
+ * Driver commands:
+ *     TSTP, INT, QUIT, KILL  Send the signal to the shell
+ *     CLOSE                  Send EOF (ctrl-d) to the shell
+ *     WAIT                   Wait for the shell to terminate
+ *     SLEEP <n>              Sleep for <n> seconds, fractions allowed
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAXLINE 1024       /* max line size */
+#define MAXARGS 32         /* max shell arguments */
+#define MAXTMP 10          /* TEMPFILE0 .. TEMPFILE9 */
+#define OUTKEEP 64         /* bytes of shell output kept for matching */
+#define TIMEOUT_MS 10000   /* give up waiting for a prompt after this */
+#define SIGWAIT_MS 2000    /* give up waiting for a signal report */
+#define NCANDIDATES 50000  /* executables on the PATH for -e */
+#define NLAUNCHERS 4       /* pool size for the pooled half of -l */
+#define FANOUT_BYTES (16 << 20) /* bytes each run of -o copies */
+
+static char prompt[] = "tsh> ";
+static int verbose = 0;
+
+/* A growable array of latency samples in microseconds */
+struct samples {
+    double *v;
+    int n, cap;
+};
+
+/* One shell under test and what we are waiting to see from it */
+struct session {
+    pid_t pid;         /* shell pid */
+    int fd;            /* pty master */
+    int alive;         /* shell not yet reaped */
+    char tail[OUTKEEP + 1]; /* last bytes of output */
+    int cmd_pending;   /* a command was sent, no prompt yet */
+    double cmd_start;
+    char cmd_tag;      /* sample tag for the turnaround: T or I */
+    int sig_pending;   /* a signal was sent, no report yet */
+    double sig_start;
+    FILE *out;         /* where to write samples */
+};
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void unix_error(char *msg)
+{
+    fprintf(stderr, "tshbench: %s: %s\n", msg, strerror(errno));
+    exit(2);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tshbench [-hv] [-s <shell>] [-a <args>] [-j <n>] [-n <runs>]\n"
+                    "                [-c <n>] [-e <n>] [-l <n>] [-o <n>] [-q <n>]\n"
+                    "                [-b <baseline>] [-w <baseline>] [-r <pct>] [<trace>...]\n");
+    fprintf(stderr, "  -h            Print this message\n");
+    fprintf(stderr, "  -v            Echo the shell output\n");
+    fprintf(stderr, "  -s <shell>    Shell program to test (default ./tsh)\n");
+    fprintf(stderr, "  -a <args>     Shell arguments (the prompt must stay on)\n");
+    fprintf(stderr, "  -j <n>        Run up to <n> traces in parallel\n");
+    fprintf(stderr, "  -n <runs>     Replay every trace <runs> times\n");
+    fprintf(stderr, "  -c <n>        Also time <n> ctrl-c keypresses on a foreground job\n");
+    fprintf(stderr, "  -e <n>        Also time <n> keystrokes in the line editor\n");
+    fprintf(stderr, "  -l <n>        Also time <n> launches with and without launchers\n");
+    fprintf(stderr, "  -o <n>        Also time <n> copies to two files with /bin/tee and fan-out\n");
+    fprintf(stderr, "  -q <n>        Also time <n> queries to a coprocess and to a process each\n");
+    fprintf(stderr, "  -b <file>     Fail if results regress against this baseline\n");
+    fprintf(stderr, "  -w <file>     Write the results as a new baseline\n");
+    fprintf(stderr, "  -r <pct>      Allowed regression in percent (default 25)\n");
+    exit(2);
+}
+
+/*
+ * spawn_shell - Start the shell as a session leader on a new pty with
+ *    echo off, so that its output is just what it prints. term is the
+ *    TERM it sees; "dumb" keeps the line editor off.
+ */
+static void spawn_shell(struct session *s, char *shell, char **args, char *term)
+{
+    struct termios tio;
+    char *slave;
+    int fd;
+
+    if ((s->fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0)
+        unix_error("posix_openpt");
+    if (grantpt(s->fd) < 0 || unlockpt(s->fd) < 0 ||
+        (slave = ptsname(s->fd)) == NULL)
+        unix_error("pty setup");
+
+    if ((s->pid = fork()) < 0)
+        unix_error("fork");
+    if (s->pid == 0) {
+        setsid();
+        if ((fd = open(slave, O_RDWR)) < 0)
+            unix_error("open pty slave");
+        tcgetattr(fd, &tio);
+        tio.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHONL);
+        tio.c_oflag &= ~ONLCR;
+        tcsetattr(fd, TCSANOW, &tio);
+        dup2(fd, 0);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        if (fd > 2)
+            close(fd);
+        close(s->fd);
+        setenv("TERM", term, 1);
+        execv(shell, args);
+        unix_error("execv");
+    }
+    s->alive = 1;
+    s->tail[0] = '\0';
+    s->cmd_tag = 'T';
+    s->cmd_pending = s->sig_pending = 0;
+}
+
+/* endswith - Does s end with suffix? */
+static int endswith(const char *s, const char *suffix)
+{
+    size_t n = strlen(s), m = strlen(suffix);
+
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+/*
+ * pump - Read shell output until deadline (or until stop() holds),
+ *    recording a turnaround sample at each prompt and a signal sample
+ *    at each stop/termination report.
+ */
+static void pump(struct session *s, double deadline, int (*stop)(struct session *))
+{
+    struct pollfd pfd;
+    char buf[4096];
+    char scan[OUTKEEP + sizeof(buf) + 1];
+    int n, ms, status;
+
+    while (s->alive && !(stop && stop(s))) {
+        ms = (int)((deadline - now_us()) / 1000);
+        if (ms < 0)
+            break;
+        pfd.fd = s->fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, ms > 100 ? 100 : ms) < 0 && errno != EINTR)
+            unix_error("poll");
+
+        if (waitpid(s->pid, &status, WNOHANG) == s->pid)
+            s->alive = 0;
+        if (!(pfd.revents & (POLLIN | POLLHUP)))
+            continue;
+        if ((n = read(s->fd, buf, sizeof(buf) - 1)) <= 0) {
+            if (!s->alive || errno == EIO)
+                break;
+            continue;
+        }
+        buf[n] = '\0';
+        if (verbose)
+            fwrite(buf, 1, n, stdout);
+
+        strcpy(scan, s->tail);
+        strcat(scan, buf);
+        if (s->sig_pending && (strstr(scan, "by signal") != NULL)) {
+            fprintf(s->out, "S %.1f\n", now_us() - s->sig_start);
+            s->sig_pending = 0;
+        }
+        if (s->cmd_pending && endswith(scan, prompt)) {
+            if (s->cmd_start > 0)
+                fprintf(s->out, "%c %.1f\n", s->cmd_tag, now_us() - s->cmd_start);
+            s->cmd_pending = 0;
+        }
+        n = strlen(scan);
+        strcpy(s->tail, scan + (n > OUTKEEP ? n - OUTKEEP : 0));
+    }
+}
+
+static int no_cmd_pending(struct session *s)
+{
+    return !s->cmd_pending;
+}
+
+static int no_sig_pending(struct session *s)
+{
+    return !s->sig_pending;
+}
+
+/*
+ * subst_tempfiles - Replace TEMPFILE<n> in line by a per-run temporary
+ *    file, as sdriver.pl does, so that parallel runs don't collide.
+ */
+static void subst_tempfiles(char *line, char tmpnames[MAXTMP][32])
+{
+    char out[MAXLINE];
+    char *p, *o = out;
+    int k, fd;
+
+    for (p = line; *p && o - out < MAXLINE - 32; ) {
+        if (strncmp(p, "TEMPFILE", 8) == 0 && p[8] >= '0' && p[8] <= '9') {
+            k = p[8] - '0';
+            if (tmpnames[k][0] == '\0') {
+                sprintf(tmpnames[k], "tshtmp-%d-XXXXXX", k);
+                if ((fd = mkstemp(tmpnames[k])) < 0)
+                    unix_error("mkstemp");
+                dprintf(fd, "%s\n", tmpnames[k]);
+                close(fd);
+            }
+            o += sprintf(o, "%s", tmpnames[k]);
+            p += 9;
+        }
+        else
+            *o++ = *p++;
+    }
+    *o = '\0';
+    strcpy(line, out);
+}
+
+/*
+ * run_trace - Replay one trace against a fresh shell, writing samples
+ *    ("T usec", "S usec", "C count") to out.
+ */
+static void run_trace(char *trace, char *shell, char **args, FILE *out)
+{
+    struct session s;
+    char tmpnames[MAXTMP][32];
+    char line[MAXLINE];
+    FILE *in;
+    int cmds = 0, k, sig;
+    double secs;
+
+    if ((in = fopen(trace, "r")) == NULL)
+        unix_error(trace);
+    memset(tmpnames, 0, sizeof(tmpnames));
+    s.out = out;
+    spawn_shell(&s, shell, args, "dumb");
+
+    /* the first prompt says the shell is up; it is not a sample */
+    s.cmd_pending = 1;
+    s.cmd_start = 0;
+    pump(&s, now_us() + TIMEOUT_MS * 1000.0, no_cmd_pending);
+    s.cmd_pending = 0;
+
+    while (fgets(line, MAXLINE, in) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '#' || line[strspn(line, " \t")] == '\0')
+            continue;
+
+        sig = 0;
+        if (strstr(line, "TSTP"))
+            sig = SIGTSTP;
+        else if (strstr(line, "INT"))
+            sig = SIGINT;
+        else if (strstr(line, "QUIT"))
+            sig = SIGQUIT;
+        else if (strstr(line, "KILL"))
+            sig = SIGKILL;
+
+        if (sig) {
+            /* drain what is already there so that only reports caused
+             * by this signal are matched */
+            pump(&s, now_us() + 1000, NULL);
+            s.tail[0] = '\0';
+            s.sig_start = now_us();
+            kill(s.pid, sig);
+            if (sig == SIGTSTP || sig == SIGINT) {
+                s.sig_pending = 1;
+                pump(&s, s.sig_start + SIGWAIT_MS * 1000.0, no_sig_pending);
+                s.sig_pending = 0;
+            }
+        }
+        else if (strstr(line, "CLOSE"))
+            write(s.fd, "\004", 1);
+        else if (strstr(line, "WAIT"))
+            pump(&s, now_us() + TIMEOUT_MS * 1000.0, NULL);
+        else if (sscanf(line, "SLEEP %lf", &secs) == 1)
+            pump(&s, now_us() + secs * 1e6, NULL);
+        else {
+            /* wait for the previous command before typing the next */
+            pump(&s, now_us() + TIMEOUT_MS * 1000.0, no_cmd_pending);
+            subst_tempfiles(line, tmpnames);
+            strcat(line, "\n");
+            s.cmd_pending = 1;
+            s.cmd_start = now_us();
+            if (write(s.fd, line, strlen(line)) < 0)
+                break;
+            cmds++;
+        }
+    }
+    fclose(in);
+
+    /* let the last command finish, then send EOF and reap the shell */
+    pump(&s, now_us() + TIMEOUT_MS * 1000.0, no_cmd_pending);
+    if (s.alive)
+        write(s.fd, "\004", 1);
+    pump(&s, now_us() + 1e6, NULL);
+    if (s.alive) {
+        kill(s.pid, SIGKILL);
+        waitpid(s.pid, NULL, 0);
+    }
+    close(s.fd);
+    for (k = 0; k < MAXTMP; k++)
+        if (tmpnames[k][0])
+            unlink(tmpnames[k]);
+    fprintf(out, "C %d\n", cmds);
+}
+
+/*
+ * run_ctrlc - Start a foreground job n times and interrupt it by typing
+ *    ctrl-c on the terminal, writing "I usec" from keypress to prompt.
+ */
+static void run_ctrlc(int n, char *shell, char **args, FILE *out)
+{
+    struct session s;
+    char cmd[] = "./myspin 10\n";
+    double t;
+    int i;
+
+    s.out = out;
+    spawn_shell(&s, shell, args, "dumb");
+    s.cmd_pending = 1;
+    s.cmd_start = 0;
+    pump(&s, now_us() + TIMEOUT_MS * 1000.0, no_cmd_pending);
+
+    for (i = 0; i < n && s.alive; i++) {
+        s.cmd_pending = 1;
+        s.cmd_start = 0;
+        if (write(s.fd, cmd, strlen(cmd)) < 0)
+            break;
+
+        /* wait until the job owns the terminal; a shell that keeps the
+         * terminal for itself gets 20 ms to start the job instead */
+        t = now_us();
+        while (tcgetpgrp(s.fd) == s.pid && now_us() - t < 20000)
+            usleep(100);
+        if (tcgetpgrp(s.fd) == s.pid)
+            usleep(20000 - (useconds_t)(now_us() - t));
+
+        s.cmd_tag = 'I';
+        s.cmd_start = now_us();
+        if (write(s.fd, "\003", 1) < 0)
+            break;
+        pump(&s, now_us() + TIMEOUT_MS * 1000.0, no_cmd_pending);
+    }
+
+    write(s.fd, "\004", 1);
+    pump(&s, now_us() + 1e6, NULL);
+    if (s.alive) {
+        kill(s.pid, SIGKILL);
+        waitpid(s.pid, NULL, 0);
+    }
+    close(s.fd);
+}
+
+/*
+ * expect - Read shell output until it contains needle. Returns the
+ *    time it was seen, or -1 on timeout.
+ */
+static double expect(struct session *s, const char *needle)
+{
+    char seen[4096];
+    double deadline = now_us() + TIMEOUT_MS * 1000.0;
+    struct pollfd pfd;
+    int len = 0, n;
+
+    seen[0] = '\0';
+    while (strstr(seen, needle) == NULL) {
+        if (now_us() > deadline)
+            return -1;
+        pfd.fd = s->fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        if ((n = read(s->fd, seen + len, sizeof(seen) - 1 - len)) <= 0)
+            return -1;
+        if (verbose)
+            fwrite(seen + len, 1, n, stdout);
+        len += n;
+        seen[len] = '\0';
+        if (len > (int)sizeof(seen) / 2) {
+            memmove(seen, seen + len - 256, 256);
+            len = 256;
+            seen[len] = '\0';
+        }
+    }
+    return now_us();
+}
+
+/*
+ * run_echo - Type n keys into the line editor with NCANDIDATES commands
+ *    on the PATH, writing "E usec" from key to echo and "K usec" from
+ *    Tab to the completed word.
+ */
+static void run_echo(int n, char *shell, char **args, FILE *out)
+{
+    struct session s;
+    char dir[] = "/tmp/tshbench-path-XXXXXX";
+    char path[MAXLINE], key[MAXLINE], want[2 * MAXLINE];
+    double t, done;
+    int i, fd;
+
+    if (mkdtemp(dir) == NULL)
+        unix_error("mkdtemp");
+    for (i = 0; i < NCANDIDATES; i++) {
+        sprintf(path, "%s/cmd%05d", dir, i);
+        if ((fd = open(path, O_CREAT | O_WRONLY, 0755)) < 0)
+            unix_error("open");
+        close(fd);
+    }
+    setenv("PATH", dir, 1);
+
+    s.out = out;
+    spawn_shell(&s, shell, args, "xterm");
+    expect(&s, prompt);
+    /* a user reading the prompt gives the shell idle time, which it
+     * spends indexing the PATH */
+    sleep(2);
+
+    for (i = 0; i < n && s.alive; i++) {
+        if (i % 10 == 9) {
+            /* a full name, so that Tab has exactly one completion */
+            sprintf(key, "\025cmd%05d", (i * 7919) % NCANDIDATES);
+            sprintf(want, "%s/%s ", dir, key + 1);
+            if (write(s.fd, key, strlen(key)) < 0 || expect(&s, key + 1) < 0)
+                break;
+            t = now_us();
+            if (write(s.fd, "\t", 1) < 0 || (done = expect(&s, want)) < 0)
+                break;
+            fprintf(out, "K %.1f\n", done - t);
+            continue;
+        }
+        key[0] = 'a' + i % 26;
+        key[1] = '\0';
+        t = now_us();
+        if (write(s.fd, key, 1) < 0 || (done = expect(&s, key)) < 0)
+            break;
+        fprintf(out, "E %.1f\n", done - t);
+    }
+
+    write(s.fd, "\025\004", 2);
+    pump(&s, now_us() + 1e6, NULL);
+    if (s.alive) {
+        kill(s.pid, SIGKILL);
+        waitpid(s.pid, NULL, 0);
+    }
+    close(s.fd);
+    for (i = 0; i < NCANDIDATES; i++) {
+        sprintf(path, "%s/cmd%05d", dir, i);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+/*
+ * run_launch - Run /bin/echo n times forking per command, then n times
+ *    from a pool of launchers, writing "F usec" and "P usec" from the
+ *    command line to the echo's output.
+ */
+static void run_launch(int n, char *shell, char **args, FILE *out)
+{
+    struct session s;
+    char cmd[MAXLINE], want[MAXLINE];
+    double t, done;
+    int pass, i;
+
+    s.out = out;
+    spawn_shell(&s, shell, args, "dumb");
+    expect(&s, prompt);
+
+    for (pass = 0; pass < 2 && s.alive; pass++) {
+        sprintf(cmd, "LAUNCHERS=%d\n", pass ? NLAUNCHERS : 0);
+        if (write(s.fd, cmd, strlen(cmd)) < 0 || expect(&s, prompt) < 0)
+            break;
+        for (i = 0; i < n; i++) {
+            usleep(5000); /* back at the prompt; the pool refills */
+            sprintf(want, "L%d.%d\n", pass, i);
+            sprintf(cmd, "/bin/echo L%d.%d\n", pass, i);
+            t = now_us();
+            if (write(s.fd, cmd, strlen(cmd)) < 0 || (done = expect(&s, want)) < 0)
+                break;
+            fprintf(out, "%c %.1f\n", pass ? 'P' : 'F', done - t);
+        }
+    }
+
+    write(s.fd, "\004", 1);
+    pump(&s, now_us() + 1e6, NULL);
+    if (s.alive) {
+        kill(s.pid, SIGKILL);
+        waitpid(s.pid, NULL, 0);
+    }
+    close(s.fd);
+}
+
+/*
+ * run_fanout - Copy FANOUT_BYTES into two files and wc -c n times with
+ *    /bin/tee and n times with the shell's fan-out, taking turns, writing
+ *    "X usec" for tee and "Y usec" for fan-out.
+ */
+static void run_fanout(int n, char *shell, char **args, FILE *out)
+{
+    struct session s;
+    char dir[] = "/tmp/tshbench-fan-XXXXXX";
+    char a[64], b[64], cmd[MAXLINE], want[32];
+    struct stat sa, sb;
+    double t, done;
+    int pass, i, tries;
+
+    if (mkdtemp(dir) == NULL)
+        unix_error("mkdtemp");
+    sprintf(a, "%s/a", dir);
+    sprintf(b, "%s/b", dir);
+    sprintf(want, "%d\n%s", FANOUT_BYTES, prompt);
+
+    s.out = out;
+    spawn_shell(&s, shell, args, "dumb");
+    expect(&s, prompt);
+
+    for (i = 0; i < n && s.alive; i++) {
+        for (pass = 0; pass < 2; pass++) {
+            if (pass)
+                sprintf(cmd, "./myflood %d > %s > %s | /bin/wc -c\n", FANOUT_BYTES, a, b);
+            else
+                sprintf(cmd, "./myflood %d | /bin/tee %s %s | /bin/wc -c\n", FANOUT_BYTES, a, b);
+            t = now_us();
+            if (write(s.fd, cmd, strlen(cmd)) < 0 || (done = expect(&s, want)) < 0)
+                break;
+            /* a tee may still be writing its files after wc is done */
+            for (tries = 0; tries < 1000; tries++) {
+                if (stat(a, &sa) == 0 && stat(b, &sb) == 0 &&
+                    sa.st_size == FANOUT_BYTES && sb.st_size == FANOUT_BYTES)
+                    break;
+                usleep(1000);
+                done = now_us();
+            }
+            if (tries < 1000)
+                fprintf(out, "%c %.1f\n", pass ? 'Y' : 'X', done - t);
+        }
+    }
+
+    write(s.fd, "\004", 1);
+    pump(&s, now_us() + 1e6, NULL);
+    if (s.alive) {
+        kill(s.pid, SIGKILL);
+        waitpid(s.pid, NULL, 0);
+    }
+    close(s.fd);
+    unlink(a);
+    unlink(b);
+    rmdir(dir);
+}
+
+/*
+ * run_coproc - Send n queries to ./myserver running as a coprocess and
+ *    run it n times with a query each, taking turns, writing "Q usec"
+ *    for the coprocess and "N usec" for a new process.
+ */
+static void run_coproc(int n, char *shell, char **args, FILE *out)
+{
+    struct session s;
+    char cmd[MAXLINE], want[MAXLINE];
+    double t, done;
+    int pass, i;
+
+    s.out = out;
+    spawn_shell(&s, shell, args, "dumb");
+    expect(&s, prompt);
+    sprintf(cmd, "coproc Q ./myserver\n");
+    if (write(s.fd, cmd, strlen(cmd)) < 0)
+        s.alive = 0;
+    expect(&s, prompt);
+
+    for (i = 0; i < n && s.alive; i++) {
+        for (pass = 0; pass < 2; pass++) {
+            if (pass)
+                sprintf(cmd, "./myserver q%d\n", i);
+            else
+                sprintf(cmd, "echo q%d >&Q; read r <&Q; echo $r\n", i);
+            sprintf(want, "q%d ok\n%s", i, prompt);
+            t = now_us();
+            if (write(s.fd, cmd, strlen(cmd)) < 0 || (done = expect(&s, want)) < 0)
+                break;
+            fprintf(out, "%c %.1f\n", pass ? 'N' : 'Q', done - t);
+        }
+    }
+
+    write(s.fd, "coproc -c Q\n\004", 13);
+    pump(&s, now_us() + 1e6, NULL);
+    if (s.alive) {
+        kill(s.pid, SIGKILL);
+        waitpid(s.pid, NULL, 0);
+    }
+    close(s.fd);
+}
+
+/* forks_since_boot - The kernel's count of processes created */
+static long forks_since_boot(void)
+{
+    char line[256];
+    long n = -1;
+    FILE *f;
+
+    if ((f = fopen("/proc/stat", "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "processes %ld", &n) == 1)
+            break;
+    fclose(f);
+    return n;
+}
+
+static void add_sample(struct samples *a, double v)
+{
+    if (a->n == a->cap) {
+        a->cap = a->cap ? 2 * a->cap : 256;
+        if ((a->v = realloc(a->v, a->cap * sizeof(double))) == NULL)
+            unix_error("realloc");
+    }
+    a->v[a->n++] = v;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* percentile - p-th percentile in milliseconds, or -1 if no samples */
+static double percentile(struct samples *a, double p)
+{
+    int i;
+
+    if (a->n == 0)
+        return -1;
+    qsort(a->v, a->n, sizeof(double), cmp_double);
+    i = (int)(p / 100.0 * (a->n - 1) + 0.5);
+    return a->v[i] / 1000.0;
+}
+
+/* The numbers that are stored in, and compared against, a baseline */
+#define NMETRICS 23
+static const char *metric_names[NMETRICS] = {
+    "turnaround_p50_ms", "turnaround_p99_ms",
+    "signal_p50_ms", "signal_p99_ms",
+    "ctrlc_p50_ms", "ctrlc_p99_ms",
+    "echo_p50_ms", "echo_p99_ms",
+    "complete_p50_ms", "complete_p99_ms",
+    "launch_fork_p50_ms", "launch_fork_p99_ms",
+    "launch_pool_p50_ms", "launch_pool_p99_ms",
+    "fanout_tee_p50_ms", "fanout_tee_p99_ms",
+    "fanout_splice_p50_ms", "fanout_splice_p99_ms",
+    "query_coproc_p50_ms", "query_coproc_p99_ms",
+    "query_spawn_p50_ms", "query_spawn_p99_ms", "forks_per_sec"
+};
+
+/*
+ * check_baseline - Compare the latency metrics against a stored baseline.
+ *    Returns the number of regressions, or -1 if there is no baseline.
+ */
+static int check_baseline(char *file, double *m, double tolerance)
+{
+    char name[64];
+    double base;
+    int i, bad = 0;
+    FILE *f;
+
+    if ((f = fopen(file, "r")) == NULL) {
+        printf("no baseline in %s: make bench-baseline records one, "
+               "make bench BENCHCHECK= skips the check\n", file);
+        return -1;
+    }
+    while (fscanf(f, "%63s %lf", name, &base) == 2) {
+        for (i = 0; i < NMETRICS - 1; i++) {
+            /* fork rate is system-wide and only reported */
+            if (strcmp(name, metric_names[i]) != 0 || base < 0 || m[i] < 0)
+                continue;
+            /* allow 1 ms of jitter on top of the relative tolerance */
+            if (m[i] > base * (1 + tolerance / 100.0) + 1.0) {
+                printf("REGRESSION %s: %.2f ms, baseline %.2f ms\n",
+                       name, m[i], base);
+                bad++;
+            }
+        }
+    }
+    fclose(f);
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    char *shell = "./tsh";
+    char *shellargs = NULL;
+    char *baseline = NULL, *newbaseline = NULL;
+    char *args[MAXARGS];
+    double tolerance = 25.0;
+    int parallel = sysconf(_SC_NPROCESSORS_ONLN);
+    int runs = 1;
+    int ctrlc = 0, echo = 0, launch = 0, fanout = 0, query = 0;
+    int c, i, nargs, running = 0, next = 0, total, cmds = 0;
+    struct samples turn = {NULL, 0, 0}, sigs = {NULL, 0, 0}, intr = {NULL, 0, 0};
+    struct samples keys = {NULL, 0, 0}, tabs = {NULL, 0, 0};
+    struct samples forked = {NULL, 0, 0}, pooled = {NULL, 0, 0};
+    struct samples teed = {NULL, 0, 0}, spliced = {NULL, 0, 0};
+    struct samples queried = {NULL, 0, 0}, spawned = {NULL, 0, 0};
+    double t0, wall, m[NMETRICS];
+    long forks0;
+    char line[128];
+    int pfd[2];
+    FILE *in;
+
+    while ((c = getopt(argc, argv, "hvs:a:j:n:c:e:l:o:q:b:w:r:")) != EOF) {
+        switch (c) {
+        case 'v': verbose = 1; break;
+        case 's': shell = optarg; break;
+        case 'a': shellargs = optarg; break;
+        case 'j': parallel = atoi(optarg); break;
+        case 'n': runs = atoi(optarg); break;
+        case 'c': ctrlc = atoi(optarg); break;
+        case 'e': echo = atoi(optarg); break;
+        case 'l': launch = atoi(optarg); break;
+        case 'o': fanout = atoi(optarg); break;
+        case 'q': query = atoi(optarg); break;
+        case 'b': baseline = optarg; break;
+        case 'w': newbaseline = optarg; break;
+        case 'r': tolerance = atof(optarg); break;
+        default: usage();
+        }
+    }
+    if ((optind == argc && ctrlc <= 0 && echo <= 0 && launch <= 0 && fanout <= 0 &&
+         query <= 0) ||
+        parallel < 1 || runs < 1)
+        usage();
+    if (verbose)
+        parallel = 1; /* keep the echoed output readable */
+
+    nargs = 0;
+    args[nargs++] = shell;
+    if (shellargs != NULL)
+        for (char *t = strtok(shellargs, " "); t && nargs < MAXARGS - 1; t = strtok(NULL, " "))
+            args[nargs++] = t;
+    args[nargs] = NULL;
+
+    /* every worker writes its samples to one pipe; lines are short
+     * enough that the writes never interleave */
+    if (pipe(pfd) < 0)
+        unix_error("pipe");
+    /* nothing reads it until all workers are done, and -q alone writes
+     * two samples per query */
+    fcntl(pfd[1], F_SETPIPE_SZ, 1 << 20);
+    total = (argc - optind) * runs + (ctrlc > 0) + (echo > 0) + (launch > 0) + (fanout > 0) +
+            (query > 0);
+    forks0 = forks_since_boot();
+    t0 = now_us();
+
+    while (next < total || running > 0) {
+        if (next < total && running < parallel) {
+            pid_t pid = fork();
+            if (pid < 0)
+                unix_error("fork");
+            if (pid == 0) {
+                FILE *out;
+                close(pfd[0]);
+                out = fdopen(pfd[1], "w");
+                setvbuf(out, NULL, _IOLBF, 0);
+                int last = total - 1 - (query > 0);
+                if (next == total - 1 && query > 0)
+                    run_coproc(query, shell, args, out);
+                else if (next == last && fanout > 0)
+                    run_fanout(fanout, shell, args, out);
+                else if (next == last - (fanout > 0) && launch > 0)
+                    run_launch(launch, shell, args, out);
+                else if (next == last - (fanout > 0) - (launch > 0) && echo > 0)
+                    run_echo(echo, shell, args, out);
+                else if (next >= (argc - optind) * runs)
+                    run_ctrlc(ctrlc, shell, args, out);
+                else
+                    run_trace(argv[optind + next % (argc - optind)], shell, args, out);
+                fclose(out);
+                exit(0);
+            }
+            next++;
+            running++;
+            continue;
+        }
+        if (wait(NULL) > 0)
+            running--;
+    }
+    wall = (now_us() - t0) / 1e6;
+    close(pfd[1]);
+
+    in = fdopen(pfd[0], "r");
+    while (fgets(line, sizeof(line), in) != NULL) {
+        double v = atof(line + 2);
+        if (line[0] == 'T')
+            add_sample(&turn, v);
+        else if (line[0] == 'S')
+            add_sample(&sigs, v);
+        else if (line[0] == 'I')
+            add_sample(&intr, v);
+        else if (line[0] == 'E')
+            add_sample(&keys, v);
+        else if (line[0] == 'K')
+            add_sample(&tabs, v);
+        else if (line[0] == 'F')
+            add_sample(&forked, v);
+        else if (line[0] == 'P')
+            add_sample(&pooled, v);
+        else if (line[0] == 'X')
+            add_sample(&teed, v);
+        else if (line[0] == 'Y')
+            add_sample(&spliced, v);
+        else if (line[0] == 'Q')
+            add_sample(&queried, v);
+        else if (line[0] == 'N')
+            add_sample(&spawned, v);
+        else if (line[0] == 'C')
+            cmds += (int)v;
+    }
+    fclose(in);
+
+    m[0] = percentile(&turn, 50);
+    m[1] = percentile(&turn, 99);
+    m[2] = percentile(&sigs, 50);
+    m[3] = percentile(&sigs, 99);
+    m[4] = percentile(&intr, 50);
+    m[5] = percentile(&intr, 99);
+    m[6] = percentile(&keys, 50);
+    m[7] = percentile(&keys, 99);
+    m[8] = percentile(&tabs, 50);
+    m[9] = percentile(&tabs, 99);
+    m[10] = percentile(&forked, 50);
+    m[11] = percentile(&forked, 99);
+    m[12] = percentile(&pooled, 50);
+    m[13] = percentile(&pooled, 99);
+    m[14] = percentile(&teed, 50);
+    m[15] = percentile(&teed, 99);
+    m[16] = percentile(&spliced, 50);
+    m[17] = percentile(&spliced, 99);
+    m[18] = percentile(&queried, 50);
+    m[19] = percentile(&queried, 99);
+    m[20] = percentile(&spawned, 50);
+    m[21] = percentile(&spawned, 99);
+    m[22] = forks0 < 0 ? -1 : (forks_since_boot() - forks0) / wall;
+
+    printf("tshbench: %d trace runs, %d in parallel, %.2f s wall\n",
+           total, parallel, wall);
+    printf("  commands             %d\n", cmds);
+    printf("  turnaround p50/p99   %.2f / %.2f ms (%d samples)\n", m[0], m[1], turn.n);
+    printf("  signal     p50/p99   %.2f / %.2f ms (%d samples)\n", m[2], m[3], sigs.n);
+    if (ctrlc > 0)
+        printf("  ctrl-c     p50/p99   %.2f / %.2f ms (%d samples)\n", m[4], m[5], intr.n);
+    if (echo > 0) {
+        printf("  echo       p50/p99   %.2f / %.2f ms (%d samples)\n", m[6], m[7], keys.n);
+        printf("  completion p50/p99   %.2f / %.2f ms (%d samples)\n", m[8], m[9], tabs.n);
+    }
+    if (launch > 0) {
+        printf("  launch/fork p50/p99  %.2f / %.2f ms (%d samples)\n", m[10], m[11], forked.n);
+        printf("  launch/pool p50/p99  %.2f / %.2f ms (%d samples)\n", m[12], m[13], pooled.n);
+    }
+    if (fanout > 0) {
+        printf("  tee        p50/p99   %.2f / %.2f ms (%d samples)\n", m[14], m[15], teed.n);
+        printf("  fan-out    p50/p99   %.2f / %.2f ms (%d samples)\n", m[16], m[17], spliced.n);
+    }
+    if (query > 0) {
+        printf("  coproc     p50/p99   %.2f / %.2f ms (%d samples)\n", m[18], m[19], queried.n);
+        printf("  spawn      p50/p99   %.2f / %.2f ms (%d samples)\n", m[20], m[21], spawned.n);
+    }
+    printf("  fork rate            %.1f /s (system-wide)\n", m[22]);
+
+    if (newbaseline != NULL) {
+        FILE *f = fopen(newbaseline, "w");
+        if (f == NULL)
+            unix_error(newbaseline);
+        for (i = 0; i < NMETRICS; i++)
+            fprintf(f, "%s %.3f\n", metric_names[i], m[i]);
+        fclose(f);
+        printf("baseline written to %s\n", newbaseline);
+    }
+    if (baseline != NULL && check_baseline(baseline, m, tolerance) != 0)
+        exit(1);
+    exit(0);
+}
@@ -0,0 +1,128 @@
+/*
+ * tshctl.c - Client for the control socket of a tiny shell run as tsh -S
+ *
+ * usage: tshctl [-h] -S <socket> [<request>...]
+ *
+ * Sends the words of <request> as one request line, prints the response
+ * and exits with the outcome: 0 for OK, the status of an EXIT line (from
+ * run, wait or fg) if there was one, and 1 for ERR, whose reason goes to
+ * stderr. Without a request, every line of stdin is sent in turn and the
+ * exit status is that of the last one.
+ *
+ * Examples:
+ *     tshctl -S /tmp/tsh.sock timeout 30s ./build.sh
+ *     tshctl -S /tmp/tsh.sock wait %1
+ *     tshctl -S /tmp/tsh.sock run ./myspin 1
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAXLINE 1024 /* max line size */
+
+static void unix_error(char *msg)
+{
+    fprintf(stderr, "tshctl: %s: %s\n", msg, strerror(errno));
+    exit(2);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tshctl [-h] -S <socket> [<request>...]\n");
+    fprintf(stderr, "  -h            Print this message\n");
+    fprintf(stderr, "  -S <socket>   Control socket of a tsh -S\n");
+    exit(2);
+}
+
+/* connect_to - Connect to the control socket at path */
+static int connect_to(char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "tshctl: socket path too long\n");
+        exit(2);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        unix_error("socket");
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        unix_error(path);
+    return fd;
+}
+
+/*
+ * request - Send one request line and print its response up to the OK or
+ *    ERR that ends it. Returns the exit status for it.
+ */
+static int request(FILE *in, FILE *out, char *line)
+{
+    char buf[MAXLINE];
+    int status = 0;
+
+    fprintf(out, "%s\n", line);
+    fflush(out);
+    while (fgets(buf, MAXLINE, in) != NULL) {
+        if (strcmp(buf, "OK\n") == 0)
+            return status;
+        if (strncmp(buf, "ERR", 3) == 0) {
+            fprintf(stderr, "tshctl: %s", buf[3] ? buf + 4 : "error\n");
+            return 1;
+        }
+        if (sscanf(buf, "EXIT %d", &status) != 1)
+            fputs(buf, stdout);
+    }
+    fprintf(stderr, "tshctl: connection closed\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    char line[MAXLINE];
+    char *path = NULL;
+    FILE *in, *out;
+    int c, i, fd, len, status = 0;
+
+    while ((c = getopt(argc, argv, "+hS:")) != -1) {
+        switch (c) {
+        case 'S':
+            path = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (path == NULL)
+        usage();
+    fd = connect_to(path);
+    if ((in = fdopen(fd, "r")) == NULL || (out = fdopen(dup(fd), "w")) == NULL)
+        unix_error("fdopen");
+
+    if (optind < argc) {
+        for (i = optind, len = 0; i < argc; i++) {
+            if (len + strlen(argv[i]) + 2 > MAXLINE) {
+                fprintf(stderr, "tshctl: request too long\n");
+                exit(2);
+            }
+            len += sprintf(line + len, "%s%s", i > optind ? " " : "", argv[i]);
+        }
+        status = request(in, out, line);
+    }
+    else {
+        while (fgets(line, MAXLINE, stdin) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            status = request(in, out, line);
+        }
+    }
+    fclose(out);
+    fclose(in);
+    exit(status);
+}